@@ -40,9 +40,14 @@
 #define DISPLAY_WIDTH 600
 #define DISPLAY_HEIGHT 448
 
+#include "ufontlib.h"
+
+// fonts registered with register_font, text items look them up while they are parsed
+#define ENABLE_UFONT
+
 #include "display_items.h"
+#include "display_list.h"
 #include "display_common.h"
-#include "draw_common.h"
 #include "font.c"
 #include "spi_display.h"
 
@@ -66,6 +71,11 @@ struct SPI
     int reset_gpio;
 
     Context *ctx;
+    struct DisplayAtoms atoms;
+    struct Arena arena;
+    // fonts registered with register_font, and their decompressed glyphs
+    UFontManager *fonts;
+    UFontGlyphCache *glyph_cache;
 
     int count_to_refresh;
     uint64_t last_refresh;
@@ -176,221 +186,40 @@ static inline void draw_pixel_x(uint8_t *line_buf, int xpos, uint8_t c)
     }
 }
 
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
-
-    return drawn_pixels;
-}
+// Pixel traits for draw_common.h: colors are kept as RGBA8888 since dithering depends on the
+// pixel position.
+typedef uint32_t pixel_color_t;
 
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline pixel_color_t pixel_color_from_rgba8888(uint32_t color)
 {
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
-    }
-
-    return drawn_pixels;
+    return color;
 }
 
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline bool pixel_color_from_image(uint32_t img_pixel, bool visible_bg, pixel_color_t bgcolor, pixel_color_t *out)
 {
-    int x = item->x;
-    int width = item->width;
-
-    uint8_t r = (item->brcolor >> 24) & 0xFF;
-    uint8_t g = (item->brcolor >> 16) & 0xFF;
-    uint8_t b = (item->brcolor >> 8) & 0xFF;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
+    // any non zero alpha is drawn as opaque
+    if (img_pixel & 0xFF) {
+        *out = img_pixel;
+        return true;
+    } else if (visible_bg) {
+        *out = bgcolor;
+        return true;
     }
 
-    for (int j = xpos - x; j < width; j++) {
-        uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, r, g, b);
-        draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
+    return false;
 }
 
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline void pixel_write(uint8_t *line_buf, int xpos, int ypos, pixel_color_t color)
 {
-    int x = item->x;
-    int y = item->y;
-    bool visible_bg;
-
-    int fgcolor_r = (item->data.text_data.fgcolor >> 24) & 0xFF;
-    int fgcolor_g = (item->data.text_data.fgcolor >> 16) & 0xFF;
-    int fgcolor_b = (item->data.text_data.fgcolor >> 8) & 0xFF;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, fgcolor_r, fgcolor_g, fgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = dither_acep7(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
+    uint8_t r = (color >> 24) & 0xFF;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
 
-    return drawn_pixels;
+    draw_pixel_x(line_buf, xpos, dither_acep7(xpos, ypos, r, g, b));
 }
 
+#include "draw_common.h"
+
 void wait_some_time(Context *ctx)
 {
     struct SPI *spi = ctx->platform_data;
@@ -428,27 +257,39 @@ void maybe_refresh(Context *ctx)
     }
 }
 
-static void do_update(Context *ctx, term display_list)
+static void do_update(Context *ctx, term req)
 {
     maybe_refresh(ctx);
     // it looks like we need to wait some time
     // let's use 2 seconds
     wait_some_time(ctx);
 
-    int proper;
-    int len = term_list_length(display_list, &proper);
+    struct SPI *spi = ctx->platform_data;
+
+    // items, their text and the scanline index live until the end of the frame
+    int len;
+    BaseDisplayItem *items = display_list_parse(req, ctx, &spi->atoms, spi->fonts, &spi->arena, &len);
+    if (IS_NULL_PTR(items)) {
+        fprintf(stderr, "Failed to parse display list.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
 
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
+    if (UNLIKELY(!ufont_text_layout_resolve(items, len, spi->glyph_cache, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate text layouts.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
 
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    struct ScanlineIndex index;
+    if (UNLIKELY(!scanline_index_init(&index, items, len, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate scanline index.\n");
+        arena_reset(&spi->arena);
+        return;
     }
 
     int screen_width = DISPLAY_WIDTH;
     int screen_height = DISPLAY_HEIGHT;
-    struct SPI *spi = ctx->platform_data;
 
     struct SPIDisplay *spi_disp = &spi->spi_disp;
     spi_device_acquire_bus(spi_disp->handle, portMAX_DELAY);
@@ -476,11 +317,8 @@ static void do_update(Context *ctx, term display_list)
             spi_device_get_trans_result(spi->spi_disp.handle, &trans, portMAX_DELAY);
         }
 
-        int xpos = 0;
-        while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf, xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
+        scanline_index_seek(&index, ypos);
+        draw_row(buf, ypos, &index, 0, screen_width);
 
         spi_display_dmawrite(&spi->spi_disp, DISPLAY_WIDTH / 2, buf);
         transaction_in_progress = true;
@@ -506,12 +344,13 @@ static void do_update(Context *ctx, term display_list)
     spi_device_release_bus(spi_disp->handle);
     wait_busy_level(spi, 0);
 
-    destroy_items(items, len);
+    arena_reset(&spi->arena);
 
     update_last_refresh_ts(ctx);
 }
 
-static void process_message(Message *message, Context *ctx)
+// Returns true when the message is retained by a registered font, so it must not be disposed.
+static bool process_message(Message *message, Context *ctx)
 {
     GenMessage gen_message;
     if (UNLIKELY(port_parse_gen_message(message->message, &gen_message) != GenCallMessage)) {
@@ -525,11 +364,19 @@ static void process_message(Message *message, Context *ctx)
     }
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x6"
-                                      "update")) {
+    struct SPI *spi = ctx->platform_data;
+
+    bool retained = false;
+
+    if (cmd == spi->atoms.update || cmd == spi->atoms.update_bin) {
 
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+        do_update(ctx, req);
+
+    } else if (cmd == spi->atoms.register_font) {
+        retained = display_items_register_font(spi->fonts, req);
+        if (!retained) {
+            fprintf(stderr, "display: failed to register font.\n");
+        }
 
     } else {
 #if REPORT_UNEXPECTED_MSGS
@@ -546,6 +393,8 @@ static void process_message(Message *message, Context *ctx)
 
     send_message(gen_message.pid, return_tuple, ctx->global);
     END_WITH_STACK_HEAP(heap, ctx->global);
+
+    return retained;
 }
 
 static void process_messages(void *arg)
@@ -555,7 +404,9 @@ static void process_messages(void *arg)
     while (true) {
         Message *message;
         xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
-        process_message(message, args->ctx);
+        if (process_message(message, args->ctx)) {
+            continue;
+        }
 
         BEGIN_WITH_STACK_HEAP(1, temp_heap);
         mailbox_message_dispose(&message->base, &temp_heap);
@@ -688,6 +539,15 @@ static void display_spi_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    display_atoms_init(&spi->atoms, ctx->global);
+    arena_init(&spi->arena);
+    spi->fonts = ufont_manager_new();
+    term glyph_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "glyph_cache_size"),
+        term_from_int(UFONT_GLYPH_CACHE_DEFAULT_BUDGET), ctx->global);
+    // without a cache glyphs are inflated each frame
+    spi->glyph_cache = ufont_glyph_cache_new((term_is_integer(glyph_cache_size) && term_to_int(glyph_cache_size) >= 0)
+            ? term_to_int(glyph_cache_size)
+            : UFONT_GLYPH_CACHE_DEFAULT_BUDGET);
 
     update_last_refresh_ts(ctx);
     spi->count_to_refresh = 0;
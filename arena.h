@@ -0,0 +1,124 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <utils.h>
+
+#define ARENA_ALIGNMENT 8
+
+// Allocations that did not fit in the arena buffer, they are freed on reset.
+struct ArenaChunk
+{
+    struct ArenaChunk *next;
+    // keeps the payload ARENA_ALIGNMENT aligned on 32 bits targets
+    size_t padding;
+};
+
+// Per-frame bump allocator: memory is never freed one allocation at a time, the whole arena is
+// reset at the end of the frame instead. The buffer grows on reset to the high-water mark of the
+// frame, so steady-state frames do not touch the heap at all.
+struct Arena
+{
+    uint8_t *buffer;
+    size_t size;
+    size_t used;
+
+    struct ArenaChunk *overflow;
+    size_t overflow_size;
+};
+
+static inline size_t arena_align(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+static void arena_init(struct Arena *arena)
+{
+    arena->buffer = NULL;
+    arena->size = 0;
+    arena->used = 0;
+    arena->overflow = NULL;
+    arena->overflow_size = 0;
+}
+
+static void *arena_alloc(struct Arena *arena, size_t size)
+{
+    // zero sized allocations still return a valid pointer
+    size = arena_align((size > 0) ? size : 1);
+
+    if (arena->size - arena->used >= size) {
+        void *ptr = arena->buffer + arena->used;
+        arena->used += size;
+        return ptr;
+    }
+
+    struct ArenaChunk *chunk = malloc(sizeof(struct ArenaChunk) + size);
+    if (IS_NULL_PTR(chunk)) {
+        return NULL;
+    }
+    chunk->next = arena->overflow;
+    arena->overflow = chunk;
+    arena->overflow_size += size;
+
+    return chunk + 1;
+}
+
+static void arena_free_overflow(struct Arena *arena)
+{
+    struct ArenaChunk *chunk = arena->overflow;
+    while (chunk) {
+        struct ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->overflow = NULL;
+    arena->overflow_size = 0;
+}
+
+// Releases everything allocated since the last reset.
+static void arena_reset(struct Arena *arena)
+{
+    size_t high_water = arena->used + arena->overflow_size;
+
+    arena_free_overflow(arena);
+    arena->used = 0;
+
+    if (high_water > arena->size) {
+        // contents are discarded anyway, so there is no need to realloc
+        free(arena->buffer);
+        arena->buffer = malloc(high_water);
+        arena->size = IS_NULL_PTR(arena->buffer) ? 0 : high_water;
+    }
+}
+
+static void arena_destroy(struct Arena *arena)
+{
+    arena_free_overflow(arena);
+    free(arena->buffer);
+    arena_init(arena);
+}
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _DAMAGE_H_
+#define _DAMAGE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils.h>
+
+// display_items.h must be included before this file.
+
+// Maximum number of dirty rectangles, when there are more of them they are merged into one.
+#define DAMAGE_MAX_RECTS 16
+
+// Fixed cost of flushing one more rectangle, in pixels: it roughly accounts for window setup
+// commands and for one more sweep of the display list. Two rectangles are merged when their
+// bounding box adds fewer pixels than this.
+#define DAMAGE_RECT_COST 256
+
+struct DamageRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Set of non overlapping rectangles that must be redrawn, clipped to the screen.
+struct DamageRegion
+{
+    int width;
+    int height;
+    struct DamageRect rects[DAMAGE_MAX_RECTS];
+    int rects_count;
+};
+
+// Palettes are compared by pointer like pixels.
+static inline bool cmp_image_format(const struct ImageFormatData *a, const struct ImageFormatData *b)
+{
+    return (a->format == b->format) && (a->stride == b->stride) && (a->color == b->color) &&
+        (a->palette == b->palette) && (a->palette_len == b->palette_len);
+}
+
+static bool cmp_display_item(BaseDisplayItem *a, BaseDisplayItem *b)
+{
+    if (a->primitive != b->primitive || a->x != b->x || a->y != b->y ||
+            a->width != b->width || a->height != b->height || a->brcolor != b->brcolor) {
+        return false;
+    }
+
+    switch (a->primitive) {
+        case Image:
+            return (a->data.image_data.pix == b->data.image_data.pix) &&
+                cmp_image_format(&a->image_format, &b->image_format);
+
+        case Rect:
+            return true;
+
+        case Text:
+#ifdef ENABLE_UFONT
+            if (a->data.text_data.ufont != b->data.text_data.ufont) {
+                return false;
+            }
+#endif
+            return (a->data.text_data.fgcolor == b->data.text_data.fgcolor) &&
+                (a->data.text_data.len == b->data.text_data.len) &&
+                !memcmp(a->data.text_data.text, b->data.text_data.text, a->data.text_data.len);
+
+        case ScaledCroppedImage:
+            return (a->data.image_data_with_size.pix == b->data.image_data_with_size.pix) &&
+                (a->data.image_data_with_size.width == b->data.image_data_with_size.width) &&
+                (a->data.image_data_with_size.height == b->data.image_data_with_size.height) &&
+                (a->x_scale == b->x_scale) && (a->y_scale == b->y_scale) &&
+                (a->filter == b->filter) &&
+                (a->source_x == b->source_x) && (a->source_y == b->source_y) &&
+                cmp_image_format(&a->image_format, &b->image_format);
+
+        default: {
+            return true;
+        }
+    }
+}
+
+static inline uint32_t damage_hash_u32(uint32_t hash, uint32_t value)
+{
+    // FNV-1a, one byte at a time
+    for (int i = 0; i < 4; i++) {
+        hash ^= (value >> (i * 8)) & 0xFF;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static inline uint32_t damage_hash_ptr(uint32_t hash, const void *ptr)
+{
+    uint64_t value = (uintptr_t) ptr;
+    hash = damage_hash_u32(hash, (uint32_t) value);
+
+    return damage_hash_u32(hash, (uint32_t) (value >> 32));
+}
+
+// Items that compare equal with cmp_display_item always have the same hash, so hashes are used to
+// skip most of the comparisons (and all the string ones) when looking for a match.
+static uint32_t damage_item_hash(const BaseDisplayItem *item)
+{
+    uint32_t hash = 2166136261U;
+    hash = damage_hash_u32(hash, item->primitive);
+    hash = damage_hash_u32(hash, item->x);
+    hash = damage_hash_u32(hash, item->y);
+    hash = damage_hash_u32(hash, item->width);
+    hash = damage_hash_u32(hash, item->height);
+    hash = damage_hash_u32(hash, item->brcolor);
+
+    switch (item->primitive) {
+        case Image:
+            hash = damage_hash_ptr(hash, item->data.image_data.pix);
+            hash = damage_hash_u32(hash, item->image_format.format);
+            hash = damage_hash_u32(hash, item->image_format.color);
+            break;
+
+        case Text: {
+            hash = damage_hash_u32(hash, item->data.text_data.fgcolor);
+#ifdef ENABLE_UFONT
+            hash = damage_hash_ptr(hash, item->data.text_data.ufont);
+#endif
+            const char *text = item->data.text_data.text;
+            for (int i = 0; i < item->data.text_data.len; i++) {
+                hash ^= (uint8_t) text[i];
+                hash *= 16777619U;
+            }
+            break;
+        }
+
+        case ScaledCroppedImage:
+            hash = damage_hash_ptr(hash, item->data.image_data_with_size.pix);
+            hash = damage_hash_u32(hash, item->data.image_data_with_size.width);
+            hash = damage_hash_u32(hash, item->data.image_data_with_size.height);
+            hash = damage_hash_u32(hash, item->source_x);
+            hash = damage_hash_u32(hash, item->source_y);
+            hash = damage_hash_u32(hash, item->x_scale);
+            hash = damage_hash_u32(hash, item->y_scale);
+            hash = damage_hash_u32(hash, item->filter);
+            hash = damage_hash_u32(hash, item->image_format.format);
+            hash = damage_hash_u32(hash, item->image_format.color);
+            break;
+
+        default:
+            break;
+    }
+
+    return hash;
+}
+
+static inline int damage_rect_area(const struct DamageRect *rect)
+{
+    return rect->width * rect->height;
+}
+
+static inline bool damage_rect_intersects(const struct DamageRect *a, const struct DamageRect *b)
+{
+    return (a->x < b->x + b->width) && (b->x < a->x + a->width)
+        && (a->y < b->y + b->height) && (b->y < a->y + a->height);
+}
+
+static int damage_rect_intersection_area(const struct DamageRect *a, const struct DamageRect *b)
+{
+    if (!damage_rect_intersects(a, b)) {
+        return 0;
+    }
+
+    int x0 = (a->x > b->x) ? a->x : b->x;
+    int y0 = (a->y > b->y) ? a->y : b->y;
+    int x1 = (a->x + a->width < b->x + b->width) ? a->x + a->width : b->x + b->width;
+    int y1 = (a->y + a->height < b->y + b->height) ? a->y + a->height : b->y + b->height;
+
+    return (x1 - x0) * (y1 - y0);
+}
+
+// out can be a or b
+static void damage_rect_union(const struct DamageRect *a, const struct DamageRect *b, struct DamageRect *out)
+{
+    int x0 = (a->x < b->x) ? a->x : b->x;
+    int y0 = (a->y < b->y) ? a->y : b->y;
+    int x1 = (a->x + a->width > b->x + b->width) ? a->x + a->width : b->x + b->width;
+    int y1 = (a->y + a->height > b->y + b->height) ? a->y + a->height : b->y + b->height;
+
+    out->x = x0;
+    out->y = y0;
+    out->width = x1 - x0;
+    out->height = y1 - y0;
+}
+
+static bool damage_rect_should_merge(const struct DamageRect *a, const struct DamageRect *b)
+{
+    struct DamageRect bounding_box;
+    damage_rect_union(a, b, &bounding_box);
+    int covered = damage_rect_area(a) + damage_rect_area(b) - damage_rect_intersection_area(a, b);
+
+    return damage_rect_area(&bounding_box) - covered <= DAMAGE_RECT_COST;
+}
+
+static void damage_region_init(struct DamageRegion *region, int width, int height)
+{
+    region->width = width;
+    region->height = height;
+    region->rects_count = 0;
+}
+
+static void damage_region_clear(struct DamageRegion *region)
+{
+    region->rects_count = 0;
+}
+
+static void damage_region_mark_all(struct DamageRegion *region)
+{
+    region->rects[0].x = 0;
+    region->rects[0].y = 0;
+    region->rects[0].width = region->width;
+    region->rects[0].height = region->height;
+    region->rects_count = 1;
+}
+
+static void damage_region_remove(struct DamageRegion *region, int i)
+{
+    region->rects_count--;
+    region->rects[i] = region->rects[region->rects_count];
+}
+
+// Fallback when there are too many rectangles: a single one is always correct.
+static void damage_region_collapse(struct DamageRegion *region, const struct DamageRect *rect)
+{
+    struct DamageRect bounding_box = *rect;
+    for (int i = 0; i < region->rects_count; i++) {
+        damage_rect_union(&region->rects[i], &bounding_box, &bounding_box);
+    }
+    region->rects[0] = bounding_box;
+    region->rects_count = 1;
+}
+
+static void damage_region_add_rect(struct DamageRegion *region, const struct DamageRect *rect)
+{
+    int x0 = (rect->x > 0) ? rect->x : 0;
+    int y0 = (rect->y > 0) ? rect->y : 0;
+    int x1 = (rect->x + rect->width < region->width) ? rect->x + rect->width : region->width;
+    int y1 = (rect->y + rect->height < region->height) ? rect->y + rect->height : region->height;
+    if (x0 >= x1 || y0 >= y1) {
+        return;
+    }
+    struct DamageRect added = { .x = x0, .y = y0, .width = x1 - x0, .height = y1 - y0 };
+
+    // absorb rectangles that are cheap to merge, the grown rectangle might be worth merging with
+    // other ones, so start again every time
+    bool merged;
+    do {
+        merged = false;
+        for (int i = 0; i < region->rects_count; i++) {
+            if (damage_rect_should_merge(&region->rects[i], &added)) {
+                damage_rect_union(&region->rects[i], &added, &added);
+                damage_region_remove(region, i);
+                merged = true;
+                break;
+            }
+        }
+    } while (merged);
+
+    // rectangles that are still overlapping are cut away from the added one
+    struct DamageRect pending[DAMAGE_MAX_RECTS * 4];
+    int pending_count = 1;
+    pending[0] = added;
+
+    while (pending_count > 0) {
+        pending_count--;
+        struct DamageRect piece = pending[pending_count];
+
+        int overlapping = -1;
+        for (int i = 0; i < region->rects_count; i++) {
+            if (damage_rect_intersects(&region->rects[i], &piece)) {
+                overlapping = i;
+                break;
+            }
+        }
+
+        if (overlapping < 0) {
+            if (region->rects_count == DAMAGE_MAX_RECTS) {
+                damage_region_collapse(region, &added);
+                return;
+            }
+            region->rects[region->rects_count] = piece;
+            region->rects_count++;
+            continue;
+        }
+
+        if (pending_count + 4 > DAMAGE_MAX_RECTS * 4) {
+            damage_region_collapse(region, &added);
+            return;
+        }
+
+        const struct DamageRect *cut = &region->rects[overlapping];
+        int band_y0 = (cut->y > piece.y) ? cut->y : piece.y;
+        int band_y1 = (cut->y + cut->height < piece.y + piece.height) ? cut->y + cut->height : piece.y + piece.height;
+
+        if (piece.y < cut->y) {
+            struct DamageRect top = { piece.x, piece.y, piece.width, cut->y - piece.y };
+            pending[pending_count++] = top;
+        }
+        if (cut->y + cut->height < piece.y + piece.height) {
+            struct DamageRect bottom = { piece.x, band_y1, piece.width, piece.y + piece.height - band_y1 };
+            pending[pending_count++] = bottom;
+        }
+        if (piece.x < cut->x) {
+            struct DamageRect left = { piece.x, band_y0, cut->x - piece.x, band_y1 - band_y0 };
+            pending[pending_count++] = left;
+        }
+        if (cut->x + cut->width < piece.x + piece.width) {
+            int right_x = cut->x + cut->width;
+            struct DamageRect right = { right_x, band_y0, piece.x + piece.width - right_x, band_y1 - band_y0 };
+            pending[pending_count++] = right;
+        }
+    }
+}
+
+static void damage_region_add_item(struct DamageRegion *region, const BaseDisplayItem *item)
+{
+    struct DamageRect rect = { item->x, item->y, item->width, item->height };
+    damage_region_add_rect(region, &rect);
+}
+
+// Damages what changed between two display lists. Items of the new list are matched in order with
+// items of the old list: matched items keep their relative stacking order, so only pixels covered
+// by unmatched items (either old or new ones) can change.
+static void damage_region_diff(struct DamageRegion *region, BaseDisplayItem *orig, int orig_len,
+    BaseDisplayItem *new, int new_len)
+{
+    // common prefix and suffix are the common case, and they do not need any hash
+    int prefix = 0;
+    while (prefix < orig_len && prefix < new_len && cmp_display_item(&orig[prefix], &new[prefix])) {
+        prefix++;
+    }
+
+    int suffix = 0;
+    while (suffix < orig_len - prefix && suffix < new_len - prefix
+        && cmp_display_item(&orig[orig_len - 1 - suffix], &new[new_len - 1 - suffix])) {
+        suffix++;
+    }
+
+    int orig_end = orig_len - suffix;
+    int new_end = new_len - suffix;
+    int orig_count = orig_end - prefix;
+    int new_count = new_end - prefix;
+    if (orig_count == 0 || new_count == 0) {
+        for (int i = prefix; i < orig_end; i++) {
+            damage_region_add_item(region, &orig[i]);
+        }
+        for (int i = prefix; i < new_end; i++) {
+            damage_region_add_item(region, &new[i]);
+        }
+        return;
+    }
+
+    uint32_t *orig_hashes = malloc(sizeof(uint32_t) * orig_count);
+    if (IS_NULL_PTR(orig_hashes)) {
+        damage_region_mark_all(region);
+        return;
+    }
+    for (int i = 0; i < orig_count; i++) {
+        orig_hashes[i] = damage_item_hash(&orig[prefix + i]);
+    }
+
+    int next_orig = prefix;
+    for (int i = prefix; i < new_end; i++) {
+        uint32_t hash = damage_item_hash(&new[i]);
+
+        int found = next_orig;
+        while (found < orig_end
+            && !(orig_hashes[found - prefix] == hash && cmp_display_item(&orig[found], &new[i]))) {
+            found++;
+        }
+
+        if (found == orig_end) {
+            damage_region_add_item(region, &new[i]);
+            continue;
+        }
+
+        // skipped items have been removed (or moved above)
+        for (int j = next_orig; j < found; j++) {
+            damage_region_add_item(region, &orig[j]);
+        }
+        next_orig = found + 1;
+    }
+
+    for (int j = next_orig; j < orig_end; j++) {
+        damage_region_add_item(region, &orig[j]);
+    }
+
+    free(orig_hashes);
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _DISPLAY_ATOMS_H_
+#define _DISPLAY_ATOMS_H_
+
+#include <globalcontext.h>
+#include <term.h>
+
+// Atoms used while parsing display lists and commands. They are resolved once when the port is
+// created, so parsing is just a term comparison instead of an atom table lookup.
+struct DisplayAtoms
+{
+    // display list items
+    term image;
+    term scaled_cropped_image;
+    term rect;
+    term text;
+    term transparent;
+    term default16px;
+
+    // image formats
+    term rgba8888;
+    term rgb565;
+    term rgb565_be;
+    term a8;
+    term l8;
+    term indexed8;
+    term mono1;
+
+    // scaled_cropped_image options
+    term filter;
+    term nearest;
+    term bilinear;
+    term scale;
+
+    // commands
+    term update;
+    term update_bin;
+    term update_items;
+    term remove_items;
+    term insert_before;
+    term draw_buffer;
+    term register_font;
+};
+
+static void display_atoms_init(struct DisplayAtoms *atoms, GlobalContext *global)
+{
+    atoms->image = globalcontext_make_atom(global, ATOM_STR("\x5", "image"));
+    atoms->scaled_cropped_image = globalcontext_make_atom(global, ATOM_STR("\x14", "scaled_cropped_image"));
+    atoms->rect = globalcontext_make_atom(global, ATOM_STR("\x4", "rect"));
+    atoms->text = globalcontext_make_atom(global, ATOM_STR("\x4", "text"));
+    atoms->transparent = globalcontext_make_atom(global, ATOM_STR("\xB", "transparent"));
+    atoms->default16px = globalcontext_make_atom(global, ATOM_STR("\xB", "default16px"));
+
+    atoms->rgba8888 = globalcontext_make_atom(global, ATOM_STR("\x8", "rgba8888"));
+    atoms->rgb565 = globalcontext_make_atom(global, ATOM_STR("\x6", "rgb565"));
+    atoms->rgb565_be = globalcontext_make_atom(global, ATOM_STR("\x9", "rgb565_be"));
+    atoms->a8 = globalcontext_make_atom(global, ATOM_STR("\x2", "a8"));
+    atoms->l8 = globalcontext_make_atom(global, ATOM_STR("\x2", "l8"));
+    atoms->indexed8 = globalcontext_make_atom(global, ATOM_STR("\x8", "indexed8"));
+    atoms->mono1 = globalcontext_make_atom(global, ATOM_STR("\x5", "mono1"));
+
+    atoms->filter = globalcontext_make_atom(global, ATOM_STR("\x6", "filter"));
+    atoms->nearest = globalcontext_make_atom(global, ATOM_STR("\x7", "nearest"));
+    atoms->bilinear = globalcontext_make_atom(global, ATOM_STR("\x8", "bilinear"));
+    atoms->scale = globalcontext_make_atom(global, ATOM_STR("\x5", "scale"));
+
+    atoms->update = globalcontext_make_atom(global, ATOM_STR("\x6", "update"));
+    atoms->update_bin = globalcontext_make_atom(global, ATOM_STR("\xA", "update_bin"));
+    atoms->update_items = globalcontext_make_atom(global, ATOM_STR("\xC", "update_items"));
+    atoms->remove_items = globalcontext_make_atom(global, ATOM_STR("\xC", "remove_items"));
+    atoms->insert_before = globalcontext_make_atom(global, ATOM_STR("\xD", "insert_before"));
+    atoms->draw_buffer = globalcontext_make_atom(global, ATOM_STR("\xB", "draw_buffer"));
+    atoms->register_font = globalcontext_make_atom(global, ATOM_STR("\xD", "register_font"));
+}
+
+#endif
@@ -19,13 +19,48 @@
  */
 
 #include <context.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
-// TODO: deprecated helper, remove this
-static inline term context_make_atom(Context *ctx, AtomString string)
+#include "arena.h"
+#include "display_atoms.h"
+
+enum ScaleFilter
 {
-    return globalcontext_make_atom(ctx->global, string);
-}
+    ScaleFilterNearest = 0,
+    ScaleFilterBilinear
+};
+
+enum ImageFormat
+{
+    ImageFormatRGBA8888 = 0,
+    // 16 bits little endian
+    ImageFormatRGB565,
+    // 16 bits big endian, that is the order SPI panels expect
+    ImageFormatRGB565BE,
+    // alpha only, pixels are drawn using the image color
+    ImageFormatA8,
+    // grayscale
+    ImageFormatL8,
+    // index of a palette of RGBA8888 colors
+    ImageFormatIndexed8,
+    // 1 bit for each pixel, most significant bit first, set pixels are drawn using the image color
+    ImageFormatMono1
+};
+
+// Pixel layout of an image tuple.
+struct ImageFormatData
+{
+    enum ImageFormat format;
+    // bytes for each row, mono1 rows are padded to a whole byte
+    int stride;
+    // a8 and mono1 color, as RGBA8888
+    uint32_t color;
+    const char *palette;
+    int palette_len;
+};
 
 enum primitive
 {
@@ -36,15 +71,42 @@ enum primitive
     Text
 };
 
+struct TextCacheEntry;
+struct UFontTextLayout;
+struct UFontManager;
+
+// text is not NUL terminated: when the text term is a binary it points straight into it, since
+// the message owning the binary outlives the item.
 struct TextData
 {
     uint32_t fgcolor;
     const char *text;
+    int len;
+    // text was copied on the heap, and it must be freed by destroy_item
+    bool owned;
+#ifdef ENABLE_UFONT
+    // NULL for default16px, otherwise text is NUL terminated
+    const EpdFont *ufont;
+    // first line baseline, from the item top
+    int baseline;
+    // rasterized text, set by text_cache_resolve for the current frame
+    const struct TextCacheEntry *rendered;
+    // glyphs, set by ufont_text_layout_resolve for the current frame when text is not rendered
+    struct UFontTextLayout *layout;
+#endif
 };
 
+struct ImageCacheEntry;
+
 struct ImageData
 {
     const char *pix;
+    // pix binary can be kept alive by the image cache: either a const binary, that is never freed,
+    // or a refc binary, that can be referenced
+    bool cacheable;
+    struct RefcBinary *refc;
+    // native copy of the image, it is valid only during the frame it has been looked up for
+    const struct ImageCacheEntry *native;
 };
 
 struct ImageDataWithSize
@@ -72,45 +134,448 @@ struct BaseDisplayItem
     //used just for scaled cropped image
     int source_x;
     int source_y;
+    // 16.16 fixed point, destination pixels for each source pixel
     int x_scale;
     int y_scale;
+    enum ScaleFilter filter;
+
+    // used by image and scaled cropped image
+    struct ImageFormatData image_format;
 };
 
 typedef struct BaseDisplayItem BaseDisplayItem;
 
-static void init_item(BaseDisplayItem *item, term req, Context *ctx)
+#define SCALE_SHIFT 16
+#define SCALE_ONE (1 << SCALE_SHIFT)
+
+// largest scale factor, so that it fits 16.16 fixed point
+#define SCALE_MAX (INT32_MAX >> SCALE_SHIFT)
+
+// Scale factors can be either integers or floats, returns 0 when it is not valid.
+static int scale_from_term(term t)
+{
+    if (term_is_float(t)) {
+        avm_float_t scale = term_to_float(t);
+        // NaN fails the check too
+        if (!(scale > 0 && scale < SCALE_MAX)) {
+            return 0;
+        }
+        return (int) (scale * SCALE_ONE + 0.5);
+    }
+
+    if (!term_is_integer(t)) {
+        return 0;
+    }
+    avm_int_t scale = term_to_int(t);
+    if (scale <= 0 || scale > SCALE_MAX) {
+        return 0;
+    }
+
+    return (int) (scale << SCALE_SHIFT);
+}
+
+// {Num, Den} rational scale factor, returns 0 when it is not valid.
+static int scale_from_rational(term t)
+{
+    if (!term_is_tuple(t) || term_get_tuple_arity(t) != 2) {
+        return 0;
+    }
+    term num_term = term_get_tuple_element(t, 0);
+    term den_term = term_get_tuple_element(t, 1);
+    if (!term_is_integer(num_term) || !term_is_integer(den_term)) {
+        return 0;
+    }
+    avm_int_t num = term_to_int(num_term);
+    avm_int_t den = term_to_int(den_term);
+    if (num <= 0 || den <= 0) {
+        return 0;
+    }
+
+    int64_t scale = (((int64_t) num << SCALE_SHIFT) + den / 2) / den;
+
+    return (scale > 0 && scale <= INT32_MAX) ? (int) scale : 0;
+}
+
+// Applies scaled_cropped_image options: {filter, nearest | bilinear} and
+// {scale, {NumX, DenX}, {NumY, DenY}}, that takes precedence over the scale factors.
+static void init_scale_opts(BaseDisplayItem *item, term opts, Context *ctx, const struct DisplayAtoms *atoms)
+{
+    for (term t = opts; term_is_nonempty_list(t); t = term_get_list_tail(t)) {
+        term opt = term_get_list_head(t);
+        if (!term_is_tuple(opt) || term_get_tuple_arity(opt) < 2) {
+            goto invalid_opt;
+        }
+
+        term key = term_get_tuple_element(opt, 0);
+        if (key == atoms->filter && term_get_tuple_arity(opt) == 2) {
+            term filter = term_get_tuple_element(opt, 1);
+            if (filter == atoms->nearest) {
+                item->filter = ScaleFilterNearest;
+            } else if (filter == atoms->bilinear) {
+                item->filter = ScaleFilterBilinear;
+            } else {
+                goto invalid_opt;
+            }
+
+        } else if (key == atoms->scale && term_get_tuple_arity(opt) == 3) {
+            int x_scale = scale_from_rational(term_get_tuple_element(opt, 1));
+            int y_scale = scale_from_rational(term_get_tuple_element(opt, 2));
+            if (x_scale == 0 || y_scale == 0) {
+                goto invalid_opt;
+            }
+            item->x_scale = x_scale;
+            item->y_scale = y_scale;
+
+        } else {
+            goto invalid_opt;
+        }
+        continue;
+
+    invalid_opt:
+        fprintf(stderr, "invalid scaled_cropped_image option: ");
+        term_display(stderr, opt, ctx);
+        fprintf(stderr, "\n");
+    }
+}
+
+// Destination pixels covered by source_size - source_offset source pixels, nothing is drawn past
+// them.
+static inline int scaled_extent(int source_size, int source_offset, int scale)
+{
+    int64_t available = source_size - source_offset;
+    if (available <= 0) {
+        return 0;
+    }
+
+    return (int) ((available * scale + SCALE_ONE - 1) >> SCALE_SHIFT);
+}
+
+static void image_data_init(struct ImageData *data, term binary)
+{
+    data->pix = term_binary_data(binary);
+    data->cacheable = false;
+    data->refc = NULL;
+    data->native = NULL;
+
+    // heap binaries and sub binaries can move or be collected, so they are not cacheable
+    if (term_is_refc_binary(binary)) {
+        data->cacheable = true;
+        if (!term_refc_binary_is_const(binary)) {
+            data->refc = term_refc_binary_ptr(binary);
+        }
+    }
+}
+
+static inline uint32_t rgb565_to_rgba8888(uint16_t color)
+{
+    uint32_t r = (color >> 11) & 0x1F;
+    uint32_t g = (color >> 5) & 0x3F;
+    uint32_t b = color & 0x1F;
+
+    return ((r << 3 | r >> 2) << 24) | ((g << 2 | g >> 4) << 16) | ((b << 3 | b >> 2) << 8) | 0xFF;
+}
+
+static inline uint16_t image_read_rgb565(const uint8_t *p, enum ImageFormat format)
+{
+    return (format == ImageFormatRGB565) ? (p[0] | p[1] << 8) : (p[0] << 8 | p[1]);
+}
+
+// Reads pixel x of an image row as RGBA8888, row points to the first byte of the row.
+static inline uint32_t image_read_row_pixel(const struct ImageFormatData *format, const char *row, int x)
+{
+    const uint8_t *p = (const uint8_t *) row;
+
+    switch (format->format) {
+        case ImageFormatRGBA8888:
+            return READ_32_UNALIGNED(p + x * 4);
+
+        case ImageFormatRGB565:
+        case ImageFormatRGB565BE:
+            return rgb565_to_rgba8888(image_read_rgb565(p + x * 2, format->format));
+
+        case ImageFormatA8:
+            return (format->color & 0xFFFFFF00) | p[x];
+
+        case ImageFormatL8:
+            return ((uint32_t) p[x] << 24) | (p[x] << 16) | (p[x] << 8) | 0xFF;
+
+        case ImageFormatIndexed8:
+            if (p[x] >= format->palette_len) {
+                return 0;
+            }
+            return READ_32_UNALIGNED(format->palette + p[x] * 4);
+
+        case ImageFormatMono1:
+            return (p[x / 8] & (0x80 >> (x % 8))) ? format->color : 0;
+
+        default:
+            return 0;
+    }
+}
+
+static inline uint32_t image_read_pixel(const struct ImageFormatData *format, const char *pix, int x, int y)
+{
+    return image_read_row_pixel(format, pix + y * format->stride, x);
+}
+
+// Formats without an alpha channel always draw every pixel.
+static inline bool image_format_is_opaque(enum ImageFormat format)
+{
+    return format == ImageFormatRGB565 || format == ImageFormatRGB565BE || format == ImageFormatL8;
+}
+
+// Parses an image tuple, that is {Format, Width, Height, Pixels} and:
+// {a8 | mono1, Width, Height, Pixels, Color} and {indexed8, Width, Height, Pixels, Palette}, where
+// palette is a binary of up to 256 RGBA8888 colors.
+static bool image_tuple_parse(term img, Context *ctx, const struct DisplayAtoms *atoms,
+    struct ImageFormatData *format, int *width, int *height, term *pixels)
+{
+    if (!term_is_tuple(img) || term_get_tuple_arity(img) < 4) {
+        goto invalid_image;
+    }
+
+    term format_atom = term_get_tuple_element(img, 0);
+    term width_term = term_get_tuple_element(img, 1);
+    term height_term = term_get_tuple_element(img, 2);
+    term pixels_term = term_get_tuple_element(img, 3);
+    int arity = term_get_tuple_arity(img);
+    if (!term_is_integer(width_term) || !term_is_integer(height_term) || !term_is_binary(pixels_term)) {
+        goto invalid_image;
+    }
+    int w = term_to_int(width_term);
+    int h = term_to_int(height_term);
+    if (w < 0 || h < 0) {
+        goto invalid_image;
+    }
+
+    format->color = 0;
+    format->palette = NULL;
+    format->palette_len = 0;
+
+    if (format_atom == atoms->rgba8888 && arity == 4) {
+        format->format = ImageFormatRGBA8888;
+        format->stride = w * 4;
+    } else if (format_atom == atoms->rgb565 && arity == 4) {
+        format->format = ImageFormatRGB565;
+        format->stride = w * 2;
+    } else if (format_atom == atoms->rgb565_be && arity == 4) {
+        format->format = ImageFormatRGB565BE;
+        format->stride = w * 2;
+    } else if (format_atom == atoms->l8 && arity == 4) {
+        format->format = ImageFormatL8;
+        format->stride = w;
+    } else if ((format_atom == atoms->a8 || format_atom == atoms->mono1) && arity == 5) {
+        term color = term_get_tuple_element(img, 4);
+        if (!term_is_integer(color)) {
+            goto invalid_image;
+        }
+        format->color = ((uint32_t) term_to_int(color)) << 8 | 0xFF;
+        if (format_atom == atoms->a8) {
+            format->format = ImageFormatA8;
+            format->stride = w;
+        } else {
+            format->format = ImageFormatMono1;
+            format->stride = (w + 7) / 8;
+        }
+    } else if (format_atom == atoms->indexed8 && arity == 5) {
+        term palette = term_get_tuple_element(img, 4);
+        if (!term_is_binary(palette) || term_binary_size(palette) % 4 != 0
+            || term_binary_size(palette) > 256 * 4) {
+            goto invalid_image;
+        }
+        format->format = ImageFormatIndexed8;
+        format->stride = w;
+        format->palette = term_binary_data(palette);
+        format->palette_len = term_binary_size(palette) / 4;
+    } else {
+        fprintf(stderr, "unsupported image format: ");
+        term_display(stderr, format_atom, ctx);
+        fprintf(stderr, "\n");
+        return false;
+    }
+
+    if ((size_t) term_binary_size(pixels_term) < (size_t) format->stride * h) {
+        goto invalid_image;
+    }
+
+    *width = w;
+    *height = h;
+    *pixels = pixels_term;
+
+    return true;
+
+invalid_image:
+    fprintf(stderr, "invalid image: ");
+    term_display(stderr, img, ctx);
+    fprintf(stderr, "\n");
+
+    return false;
+}
+
+// Memory owned by items comes from arena, when it is NULL the heap is used instead and it must be
+// released with destroy_item.
+static void *display_items_alloc(struct Arena *arena, size_t size)
+{
+    return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+// Same as interop_term_to_string, but the string is allocated with display_items_alloc.
+static char *display_items_term_to_string(term t, struct Arena *arena, int *ok)
+{
+    if (term_is_binary(t)) {
+        int len = term_binary_size(t);
+        char *str = display_items_alloc(arena, len + 1);
+        if (IS_NULL_PTR(str)) {
+            *ok = 0;
+            return NULL;
+        }
+        memcpy(str, term_binary_data(t), len);
+        str[len] = '\0';
+        *ok = 1;
+        return str;
+    }
+
+    if (!term_is_list(t)) {
+        *ok = 0;
+        return NULL;
+    }
+
+    int proper;
+    int len = term_list_length(t, &proper);
+    if (!proper) {
+        *ok = 0;
+        return NULL;
+    }
+
+    char *str = display_items_alloc(arena, len + 1);
+    if (IS_NULL_PTR(str)) {
+        *ok = 0;
+        return NULL;
+    }
+
+    term l = t;
+    for (int i = 0; i < len; i++) {
+        term c = term_get_list_head(l);
+        if (!term_is_integer(c) || term_to_int(c) < 0 || term_to_int(c) > 255) {
+            if (!arena) {
+                free(str);
+            }
+            *ok = 0;
+            return NULL;
+        }
+        str[i] = (char) term_to_int(c);
+        l = term_get_list_tail(l);
+    }
+    str[len] = '\0';
+
+    *ok = 1;
+    return str;
+}
+
+// Invalid items are never drawn.
+static void init_invalid_item(BaseDisplayItem *item)
+{
+    item->primitive = Invalid;
+    item->x = -1;
+    item->y = -1;
+    item->width = 1;
+    item->height = 1;
+}
+
+static void init_text_item(BaseDisplayItem *item, term text_term, uint32_t fgcolor, uint32_t brcolor,
+    struct Arena *arena)
+{
+    const char *text;
+    int len;
+    bool owned = false;
+
+    if (term_is_binary(text_term)) {
+        text = term_binary_data(text_term);
+        len = term_binary_size(text_term);
+    } else {
+        int ok;
+        text = display_items_term_to_string(text_term, arena, &ok);
+        if (!ok) {
+            fprintf(stderr, "invalid text.\n");
+            init_invalid_item(item);
+            return;
+        }
+        len = strlen(text);
+        owned = (arena == NULL);
+    }
+
+    item->primitive = Text;
+    item->height = 16;
+    item->width = len * 8;
+    item->brcolor = brcolor;
+    item->data.text_data.fgcolor = fgcolor;
+    item->data.text_data.text = text;
+    item->data.text_data.len = len;
+    item->data.text_data.owned = owned;
+#ifdef ENABLE_UFONT
+    item->data.text_data.ufont = NULL;
+    item->data.text_data.baseline = 0;
+    item->data.text_data.rendered = NULL;
+    item->data.text_data.layout = NULL;
+#endif
+}
+
+#ifdef ENABLE_UFONT
+// Handles {register_font, Handle, Font}, fonts are looked up by the atom index of Handle. Fonts point
+// straight into the Font binary, so the message holding it must be retained when true is returned.
+static bool display_items_register_font(UFontManager *fonts, term req)
+{
+    if (IS_NULL_PTR(fonts) || term_get_tuple_arity(req) != 3) {
+        return false;
+    }
+    term handle = term_get_tuple_element(req, 1);
+    term font_bin = term_get_tuple_element(req, 2);
+    if (!term_is_atom(handle) || !term_is_binary(font_bin)) {
+        return false;
+    }
+
+    EpdFont *font = ufont_parse(term_binary_data(font_bin), term_binary_size(font_bin));
+    if (IS_NULL_PTR(font)) {
+        return false;
+    }
+    // registered fonts are never replaced, since retained items point to them
+    if (!ufont_manager_register(fonts, term_to_atom_index(handle), font)) {
+        free(font);
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+// Text items look up their font in fonts, that holds the fonts registered to the display. It can be
+// NULL when the display has none.
+static void init_item(BaseDisplayItem *item, term req, Context *ctx, const struct DisplayAtoms *atoms,
+    struct UFontManager *fonts, struct Arena *arena)
 {
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x5"
-                                      "image")) {
+    if (cmd == atoms->image) {
         item->primitive = Image;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
 
         term bgcolor = term_get_tuple_element(req, 3);
-        if (bgcolor == context_make_atom(ctx, "\xB"
-                                              "transparent")) {
+        if (bgcolor == atoms->transparent) {
             item->brcolor = 0;
         } else {
             item->brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
         }
 
         term img = term_get_tuple_element(req, 4);
-
-        term format = term_get_tuple_element(img, 0);
-        if (format != context_make_atom(ctx, "\x8"
-                                             "rgba8888")) {
-            fprintf(stderr, "unsupported image format: ");
-            term_display(stderr, format, ctx);
-            fprintf(stderr, "\n");
+        term pixels;
+        if (!image_tuple_parse(img, ctx, atoms, &item->image_format, &item->width, &item->height, &pixels)) {
+            init_invalid_item(item);
             return;
         }
-        item->width = term_to_int(term_get_tuple_element(img, 1));
-        item->height = term_to_int(term_get_tuple_element(img, 2));
-        item->data.image_data.pix = term_binary_data(term_get_tuple_element(img, 3));
+        image_data_init(&item->data.image_data, pixels);
 
-    } else if (cmd == globalcontext_make_atom(ctx->global, ATOM_STR("\x14", "scaled_cropped_image"))) {
+    } else if (cmd == atoms->scaled_cropped_image) {
         item->primitive = ScaledCroppedImage;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
@@ -118,8 +583,7 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
         item->height = term_to_int(term_get_tuple_element(req, 4));
 
         term bgcolor = term_get_tuple_element(req, 5);
-        if (bgcolor == globalcontext_make_atom(ctx->global, "\xB"
-                                              "transparent")) {
+        if (bgcolor == atoms->transparent) {
             item->brcolor = 0;
         } else {
             item->brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
@@ -127,27 +591,22 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
 
         item->source_x = term_to_int(term_get_tuple_element(req, 6));
         item->source_y = term_to_int(term_get_tuple_element(req, 7));
-        item->x_scale = term_to_int(term_get_tuple_element(req, 8));
-        item->y_scale = term_to_int(term_get_tuple_element(req, 9));
+        item->x_scale = scale_from_term(term_get_tuple_element(req, 8));
+        item->y_scale = scale_from_term(term_get_tuple_element(req, 9));
 
-        // 10th element is for opts, but right now no opts are supported
+        item->filter = ScaleFilterNearest;
+        init_scale_opts(item, term_get_tuple_element(req, 10), ctx, atoms);
 
         term img = term_get_tuple_element(req, 11);
-
-        term format = term_get_tuple_element(img, 0);
-        if (format != globalcontext_make_atom(ctx->global, "\x8"
-                                             "rgba8888")) {
-            fprintf(stderr, "unsupported image format: ");
-            term_display(stderr, format, ctx);
-            fprintf(stderr, "\n");
+        struct ImageDataWithSize *data = &item->data.image_data_with_size;
+        term pixels;
+        if (!image_tuple_parse(img, ctx, atoms, &item->image_format, &data->width, &data->height, &pixels)) {
+            init_invalid_item(item);
             return;
         }
-        item->data.image_data_with_size.width = term_to_int(term_get_tuple_element(img, 1));
-        item->data.image_data_with_size.height = term_to_int(term_get_tuple_element(img, 2));
-        item->data.image_data_with_size.pix = term_binary_data(term_get_tuple_element(img, 3));
+        data->pix = term_binary_data(pixels);
 
-    } else if (cmd == context_make_atom(ctx, "\x4"
-                                             "rect")) {
+    } else if (cmd == atoms->rect) {
         item->primitive = Rect;
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
@@ -155,85 +614,64 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
         item->height = term_to_int(term_get_tuple_element(req, 4));
         item->brcolor = term_to_int(term_get_tuple_element(req, 5)) << 8 | 0xFF;
 
-    } else if (cmd == context_make_atom(ctx, "\x4"
-                                             "text")) {
+    } else if (cmd == atoms->text) {
         item->x = term_to_int(term_get_tuple_element(req, 1));
         item->y = term_to_int(term_get_tuple_element(req, 2));
         uint32_t fgcolor = term_to_int(term_get_tuple_element(req, 4)) << 8 | 0xFF;
         uint32_t brcolor;
         term bgcolor = term_get_tuple_element(req, 5);
-        if (bgcolor == globalcontext_make_atom(ctx->global, "\xB"
-                                              "transparent")) {
+        if (bgcolor == atoms->transparent) {
             brcolor = 0;
         } else {
             brcolor = ((uint32_t) term_to_int(bgcolor)) << 8 | 0xFF;
         }
         term text_term = term_get_tuple_element(req, 6);
-        int ok;
-        char *text = interop_term_to_string(text_term, &ok);
-        if (!ok) {
-            fprintf(stderr, "invalid text.\n");
-            return;
-        }
-
         term font = term_get_tuple_element(req, 3);
 
-        if (font == globalcontext_make_atom(ctx->global, "\xB" "default16px")) {
-            item->primitive = Text;
-            item->height = 16;
-            item->width = strlen(text) * 8;
-            item->brcolor = brcolor;
-            item->data.text_data.fgcolor = fgcolor;
-            item->data.text_data.text = text;
+        if (font == atoms->default16px) {
+            init_text_item(item, text_term, fgcolor, brcolor, arena);
 
         } else {
 #ifdef ENABLE_UFONT
-            AtomString handle_atom = globalcontext_atomstring_from_term(ctx->global, font);
-            char handle[255];
-            atom_string_to_c(handle_atom, handle, sizeof(handle));
-            EpdFont *loaded_font = ufont_manager_find_by_handle(ufont_manager, handle);
-
+            EpdFont *loaded_font = (fonts && term_is_atom(font)) ? ufont_manager_find(fonts, term_to_atom_index(font)) : NULL;
             if (!loaded_font) {
                 fprintf(stderr, "unsupported font: ");
                 term_display(stderr, font, ctx);
                 fprintf(stderr, "\n");
+                init_invalid_item(item);
                 return;
             }
 
-            EpdFontProperties props = epd_font_properties_default();
-            EpdRect rect = epd_get_string_rect(loaded_font, text, 0, 0, 0, &props);
-
-            struct Surface surface;
-            surface.width = rect.width;
-            surface.height = rect.height;
-            surface.buffer = malloc(rect.width * rect.height * BPP);
-            memset(surface.buffer, 0, rect.width * rect.height * BPP);
-            int text_x = 0;
-            int text_y = loaded_font->ascender;
-            enum EpdDrawError res = epd_write_default(loaded_font, text, &text_x, &text_y, &surface);
-            free(text);
-            if (res != EPD_DRAW_SUCCESS) {
-                fprintf(stderr, "Failed to draw text. Error code: %i\n", res);
+            // ufontlib wants a NUL terminated string
+            int ok;
+            char *text = display_items_term_to_string(text_term, arena, &ok);
+            if (!ok) {
+                fprintf(stderr, "invalid text.\n");
+                init_invalid_item(item);
                 return;
             }
 
-            item->primitive = Image;
-            item->width = surface.width;
-            item->height = surface.height;
-            item->brcolor = 0;
-            //FIXME: surface buffer leak
-            item->data.image_data.pix = surface.buffer;
-#else
-            fprintf(stderr, "unsupported font: ");
-            term_display(stderr, font, ctx);
-            fprintf(stderr, "\n");
+            EpdFontProperties props = epd_font_properties_default();
+            EpdRect rect = epd_get_string_rect(loaded_font, text, 0, 0, 0, &props);
+
+            // glyphs are drawn by the rasterizer, one scanline at a time
             item->primitive = Text;
-            item->height = 16;
-            item->width = strlen(text) * 8;
+            item->width = (rect.width > 0) ? rect.width : 0;
+            item->height = (rect.height > 0) ? rect.height : 0;
             item->brcolor = brcolor;
             item->data.text_data.fgcolor = fgcolor;
             item->data.text_data.text = text;
-
+            item->data.text_data.len = strlen(text);
+            item->data.text_data.owned = (arena == NULL);
+            item->data.text_data.ufont = loaded_font;
+            item->data.text_data.baseline = loaded_font->ascender;
+            item->data.text_data.rendered = NULL;
+            item->data.text_data.layout = NULL;
+#else
+            fprintf(stderr, "unsupported font: ");
+            term_display(stderr, font, ctx);
+            fprintf(stderr, "\n");
+            init_text_item(item, text_term, fgcolor, brcolor, arena);
 #endif
         }
 
@@ -242,35 +680,27 @@ static void init_item(BaseDisplayItem *item, term req, Context *ctx)
         term_display(stderr, req, ctx);
         fprintf(stderr, "\n");
 
-        item->primitive = Invalid;
-        item->x = -1;
-        item->y = -1;
-        item->width = 1;
-        item->height = 1;
+        init_invalid_item(item);
     }
 }
 
-static void destroy_items(BaseDisplayItem *items, int items_count)
+static void destroy_item(BaseDisplayItem *item)
 {
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
-
-        switch (item->primitive) {
-            case Image:
-                break;
+    switch (item->primitive) {
+        case Image:
+            break;
 
-            case Rect:
-                break;
+        case Rect:
+            break;
 
-            case Text:
+        case Text:
+            if (item->data.text_data.owned) {
                 free((char *) item->data.text_data.text);
-                break;
-
-            default: {
-                break;
             }
+            break;
+
+        default: {
+            break;
         }
     }
-
-    free(items);
 }
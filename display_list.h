@@ -0,0 +1,295 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _DISPLAY_LIST_H_
+#define _DISPLAY_LIST_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <context.h>
+#include <term.h>
+
+// display_items.h must be included before this file.
+
+// Packed display lists, as produced by atomgl_display_list:encode/1. All integers are little
+// endian, the binary starts with a version byte and the u16 number of items, then each item is an
+// opcode byte followed by its fields:
+//   rect: i16 x, i16 y, u16 width, u16 height, u32 color
+//   text: i16 x, i16 y, u8 font, u32 fgcolor, u32 bgcolor, u16 len, len bytes of text
+//   image: i16 x, i16 y, u32 bgcolor, u16 image
+//   scaled_cropped_image: i16 x, i16 y, u16 width, u16 height, u32 bgcolor, i16 source_x,
+//     i16 source_y, u32 x_scale, u32 y_scale, u8 filter, u16 image
+// Colors are 0xRRGGBB, DISPLAY_LIST_BIN_TRANSPARENT stands for the transparent atom, scale factors
+// are 16.16 fixed point, filter is an enum ScaleFilter value, and image is an index into the
+// Images tuple sent along with the binary, that holds image tuples of any supported format.
+#define DISPLAY_LIST_BIN_VERSION 1
+#define DISPLAY_LIST_BIN_TRANSPARENT 0xFFFFFFFF
+#define DISPLAY_LIST_BIN_FONT_DEFAULT16PX 0
+
+enum DisplayListBinOp
+{
+    DisplayListBinRect = 1,
+    DisplayListBinText = 2,
+    DisplayListBinImage = 3,
+    DisplayListBinScaledCroppedImage = 4
+};
+
+struct DisplayListReader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+    bool error;
+};
+
+static inline bool display_list_reader_ensure(struct DisplayListReader *reader, size_t len)
+{
+    if (reader->size - reader->pos < len) {
+        reader->error = true;
+        return false;
+    }
+
+    return true;
+}
+
+static inline uint8_t display_list_read_u8(struct DisplayListReader *reader)
+{
+    if (!display_list_reader_ensure(reader, 1)) {
+        return 0;
+    }
+
+    return reader->data[reader->pos++];
+}
+
+static inline uint16_t display_list_read_u16(struct DisplayListReader *reader)
+{
+    if (!display_list_reader_ensure(reader, 2)) {
+        return 0;
+    }
+
+    const uint8_t *p = reader->data + reader->pos;
+    reader->pos += 2;
+
+    return p[0] | (p[1] << 8);
+}
+
+static inline int16_t display_list_read_i16(struct DisplayListReader *reader)
+{
+    return (int16_t) display_list_read_u16(reader);
+}
+
+static inline uint32_t display_list_read_u32(struct DisplayListReader *reader)
+{
+    if (!display_list_reader_ensure(reader, 4)) {
+        return 0;
+    }
+
+    const uint8_t *p = reader->data + reader->pos;
+    reader->pos += 4;
+
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t display_list_bin_bgcolor(uint32_t color)
+{
+    return (color == DISPLAY_LIST_BIN_TRANSPARENT) ? 0 : (color << 8 | 0xFF);
+}
+
+static bool display_list_bin_image(term images, int index, Context *ctx, const struct DisplayAtoms *atoms,
+    struct ImageFormatData *format, int *width, int *height, term *binary)
+{
+    if (!term_is_tuple(images) || index >= term_get_tuple_arity(images)) {
+        return false;
+    }
+
+    term img = term_get_tuple_element(images, index);
+
+    return image_tuple_parse(img, ctx, atoms, format, width, height, binary);
+}
+
+// Decodes the next item, text items point straight into the packed binary.
+static bool display_list_bin_decode_item(struct DisplayListReader *reader, BaseDisplayItem *item,
+    term images, Context *ctx, const struct DisplayAtoms *atoms)
+{
+    uint8_t op = display_list_read_u8(reader);
+    item->x = display_list_read_i16(reader);
+    item->y = display_list_read_i16(reader);
+
+    switch (op) {
+        case DisplayListBinRect:
+            item->primitive = Rect;
+            item->width = display_list_read_u16(reader);
+            item->height = display_list_read_u16(reader);
+            item->brcolor = display_list_read_u32(reader) << 8 | 0xFF;
+            break;
+
+        case DisplayListBinText: {
+            uint8_t font = display_list_read_u8(reader);
+            uint32_t fgcolor = display_list_read_u32(reader);
+            uint32_t bgcolor = display_list_read_u32(reader);
+            uint16_t len = display_list_read_u16(reader);
+            if (!display_list_reader_ensure(reader, len) || font != DISPLAY_LIST_BIN_FONT_DEFAULT16PX) {
+                return false;
+            }
+
+            item->primitive = Text;
+            item->width = len * 8;
+            item->height = 16;
+            item->brcolor = display_list_bin_bgcolor(bgcolor);
+            item->data.text_data.fgcolor = fgcolor << 8 | 0xFF;
+            item->data.text_data.text = (const char *) reader->data + reader->pos;
+            item->data.text_data.len = len;
+            item->data.text_data.owned = false;
+            reader->pos += len;
+            break;
+        }
+
+        case DisplayListBinImage: {
+            item->brcolor = display_list_bin_bgcolor(display_list_read_u32(reader));
+            int image = display_list_read_u16(reader);
+            term binary;
+            if (reader->error
+                || !display_list_bin_image(images, image, ctx, atoms, &item->image_format, &item->width,
+                    &item->height, &binary)) {
+                return false;
+            }
+            image_data_init(&item->data.image_data, binary);
+            item->primitive = Image;
+            break;
+        }
+
+        case DisplayListBinScaledCroppedImage: {
+            item->width = display_list_read_u16(reader);
+            item->height = display_list_read_u16(reader);
+            item->brcolor = display_list_bin_bgcolor(display_list_read_u32(reader));
+            item->source_x = display_list_read_i16(reader);
+            item->source_y = display_list_read_i16(reader);
+            item->x_scale = display_list_read_u32(reader);
+            item->y_scale = display_list_read_u32(reader);
+            uint8_t filter = display_list_read_u8(reader);
+            int image = display_list_read_u16(reader);
+            struct ImageDataWithSize *data = &item->data.image_data_with_size;
+            term binary;
+            if (reader->error || item->x_scale <= 0 || item->y_scale <= 0 || filter > ScaleFilterBilinear
+                || !display_list_bin_image(images, image, ctx, atoms, &item->image_format, &data->width,
+                    &data->height, &binary)) {
+                return false;
+            }
+            data->pix = term_binary_data(binary);
+            item->filter = filter;
+            item->primitive = ScaledCroppedImage;
+            break;
+        }
+
+        default:
+            return false;
+    }
+
+    return !reader->error;
+}
+
+static BaseDisplayItem *display_list_alloc_items(struct Arena *arena, int len)
+{
+    // malloc(0) is allowed to return NULL
+    size_t size = sizeof(BaseDisplayItem) * ((len > 0) ? len : 1);
+    BaseDisplayItem *items = display_items_alloc(arena, size);
+    if (IS_NULL_PTR(items)) {
+        return NULL;
+    }
+    memset(items, 0, size);
+
+    return items;
+}
+
+// Parses {update, DisplayList} and {update_bin, Binary} / {update_bin, Binary, Images} into an
+// array of items, allocated with display_items_alloc. Items that cannot be parsed are left as
+// zero sized Invalid items. Returns NULL when req is not a valid display list.
+static BaseDisplayItem *display_list_parse(term req, Context *ctx, const struct DisplayAtoms *atoms,
+    struct UFontManager *fonts, struct Arena *arena, int *items_count)
+{
+    term cmd = term_get_tuple_element(req, 0);
+    int arity = term_get_tuple_arity(req);
+
+    if (cmd == atoms->update && arity == 2) {
+        term display_list = term_get_tuple_element(req, 1);
+        int proper;
+        int len = term_list_length(display_list, &proper);
+
+        BaseDisplayItem *items = display_list_alloc_items(arena, len);
+        if (IS_NULL_PTR(items)) {
+            return NULL;
+        }
+
+        term t = display_list;
+        for (int i = 0; i < len; i++) {
+            init_item(&items[i], term_get_list_head(t), ctx, atoms, fonts, arena);
+            t = term_get_list_tail(t);
+        }
+
+        *items_count = len;
+        return items;
+    }
+
+    if (cmd != atoms->update_bin || (arity != 2 && arity != 3)) {
+        return NULL;
+    }
+
+    term bin = term_get_tuple_element(req, 1);
+    term images = (arity == 3) ? term_get_tuple_element(req, 2) : term_nil();
+    if (!term_is_binary(bin)) {
+        return NULL;
+    }
+
+    struct DisplayListReader reader;
+    reader.data = (const uint8_t *) term_binary_data(bin);
+    reader.size = term_binary_size(bin);
+    reader.pos = 0;
+    reader.error = false;
+
+    uint8_t version = display_list_read_u8(&reader);
+    int len = display_list_read_u16(&reader);
+    if (reader.error || version != DISPLAY_LIST_BIN_VERSION) {
+        fprintf(stderr, "unsupported packed display list.\n");
+        return NULL;
+    }
+
+    BaseDisplayItem *items = display_list_alloc_items(arena, len);
+    if (IS_NULL_PTR(items)) {
+        return NULL;
+    }
+
+    for (int i = 0; i < len; i++) {
+        if (!display_list_bin_decode_item(&reader, &items[i], images, ctx, atoms)) {
+            // fields are not reliable anymore, so the rest of the list is dropped
+            fprintf(stderr, "invalid packed display list item %i.\n", i);
+            memset(&items[i], 0, sizeof(BaseDisplayItem) * (len - i));
+            break;
+        }
+    }
+
+    *items_count = len;
+    return items;
+}
+
+#endif
@@ -19,74 +19,804 @@
  */
 
 #include <context.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item);
+#include <utils.h>
 
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
+#include "scanline_index.h"
+
+// Renderer core shared by all drivers. It must be included after display_items.h, font.c, the
+// pixel traits of the target format, image_cache.h when ENABLE_IMAGE_CACHE is defined,
+// ufontlib.h when ENABLE_UFONT is defined, and text_cache.h when ENABLE_TEXT_CACHE is defined. Traits
+// are:
+// - pixel_color_t: a color that is ready to be written to the line buffer
+// - pixel_color_t pixel_color_from_rgba8888(uint32_t color)
+// - bool pixel_color_from_image(uint32_t img_pixel, bool visible_bg, pixel_color_t bgcolor,
+//   pixel_color_t *out): converts an image pixel, returns false when it must be left untouched
+// - void pixel_write(uint8_t *line_buf, int xpos, int ypos, pixel_color_t color)
+// - uint8_t pixel_alpha_from_image(uint32_t img_pixel), pixel_color_blend(pixel_color_t fg,
+//   pixel_color_t bg, uint8_t alpha) and pixel_color_t pixel_read(const uint8_t *line_buf, int xpos,
+//   int ypos): optional, when PIXEL_COMPOSITE is defined partially transparent pixels are blended
+//   with the line buffer, since items are drawn bottom to top
+// - pixel_color_t pixel_color_from_rgb565(uint16_t color): optional, it must be defined together
+//   with PIXEL_NATIVE_RGB565_BE when the line buffer is made of big endian RGB565 pixels, so
+//   rgb565_be image rows are copied as they are
+// Traits are static inline, so conversions of constant colors are done once per span.
+
+// Opaque pixels are written as they are, the others are blended with the item background when it
+// is visible, otherwise with what items below already drew in the line buffer.
+static inline void draw_image_pixel(uint8_t *line_buf, int xpos, int ypos, uint32_t img_pixel,
+    bool visible_bg, pixel_color_t bgcolor)
 {
-    int line_len = DISPLAY_WIDTH - xpos;
+    pixel_color_t color;
+    if (pixel_color_from_image(img_pixel, visible_bg, bgcolor, &color)) {
+        pixel_write(line_buf, xpos, ypos, color);
+        return;
+    }
 
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
+#ifdef PIXEL_COMPOSITE
+    uint8_t alpha = pixel_alpha_from_image(img_pixel);
+    if (alpha != 0) {
+        pixel_color_t below = pixel_read(line_buf, xpos, ypos);
+        pixel_write(line_buf, xpos, ypos, pixel_color_blend(pixel_color_from_rgba8888(img_pixel), below, alpha));
+    }
+#endif
+}
+
+#ifndef PIXEL_NATIVE_RGB565_BE
+static inline pixel_color_t pixel_color_from_rgb565(uint16_t color)
+{
+    return pixel_color_from_rgba8888(rgb565_to_rgba8888(color));
+}
+#endif
+
+static void draw_image_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+
+    pixel_color_t bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = pixel_color_from_rgba8888(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int width = item->width;
+    const struct ImageFormatData *format = &item->image_format;
+    const char *row = item->data.image_data.pix + (ypos - y) * format->stride;
+
+    int drawn_pixels = 0;
+
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    int j = xpos - x;
+    if (j >= width) {
+        return;
+    }
+
+    switch (format->format) {
+        case ImageFormatRGBA8888: {
+            const uint32_t *pixels = ((const uint32_t *) row) + j;
+            for (; j < width; j++) {
+                uint32_t img_pixel = READ_32_UNALIGNED(pixels);
+                draw_image_pixel(line_buf, xpos + drawn_pixels, ypos, img_pixel, visible_bg, bgcolor);
+                drawn_pixels++;
+                pixels++;
+            }
+            break;
+        }
+
+        case ImageFormatRGB565:
+        case ImageFormatRGB565BE: {
+#ifdef PIXEL_NATIVE_RGB565_BE
+            if (format->format == ImageFormatRGB565BE) {
+                memcpy(((pixel_color_t *) line_buf) + xpos, row + j * 2, (width - j) * sizeof(pixel_color_t));
+                break;
+            }
+#endif
+            const uint8_t *pixels = ((const uint8_t *) row) + j * 2;
+            for (; j < width; j++) {
+                pixel_write(line_buf, xpos + drawn_pixels, ypos,
+                    pixel_color_from_rgb565(image_read_rgb565(pixels, format->format)));
+                drawn_pixels++;
+                pixels += 2;
+            }
+            break;
+        }
+
+        default:
+            for (; j < width; j++) {
+                uint32_t img_pixel = image_read_row_pixel(format, row, j);
+                draw_image_pixel(line_buf, xpos + drawn_pixels, ypos, img_pixel, visible_bg, bgcolor);
+                drawn_pixels++;
+            }
+            break;
+    }
+}
+
+#ifdef ENABLE_IMAGE_CACHE
+// Draws the native copy of an image one run at a time: opaque runs are copied as they are,
+// transparent ones are skipped unless there is a background, and only partial ones are blended.
+static void draw_native_image_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    const struct ImageCacheEntry *native = item->data.image_data.native;
+    int x = item->x;
+    int src_y = ypos - item->y;
+
+    int width = item->width;
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    int j = xpos - x;
+    if (j >= width) {
+        return;
+    }
+
+    pixel_color_t bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = pixel_color_from_rgba8888(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    const pixel_color_t *pixels = native->pixels + src_y * native->width;
+    const struct ImageRun *run = image_cache_entry_find_run(native, j, src_y);
+    const struct ImageRun *row_end = native->runs + native->row_runs[src_y + 1];
+
+    while (j < width) {
+        int run_end = (run + 1 < row_end) ? run[1].x : native->width;
+        if (run_end > width) {
+            run_end = width;
+        }
+
+        switch (run->kind) {
+            case ImageRunOpaque:
+                memcpy(((pixel_color_t *) line_buf) + x + j, pixels + j, (run_end - j) * sizeof(pixel_color_t));
+                break;
+
+            case ImageRunTransparent:
+                if (visible_bg) {
+                    for (int k = j; k < run_end; k++) {
+                        pixel_write(line_buf, x + k, ypos, bgcolor);
+                    }
+                }
+                break;
+
+            default: {
+                const uint8_t *alpha = native->alpha + src_y * native->width;
+                for (int k = j; k < run_end; k++) {
+                    pixel_color_t below;
+                    if (visible_bg) {
+                        below = bgcolor;
+                    } else {
+#ifdef PIXEL_COMPOSITE
+                        below = pixel_read(line_buf, x + k, ypos);
+#else
+                        continue;
+#endif
+                    }
+                    pixel_write(line_buf, x + k, ypos, pixel_color_blend(pixels[k], below, alpha[k]));
+                }
+                break;
+            }
+        }
+
+        j = run_end;
+        run++;
+    }
+}
+#endif
+
+// Source pixels are stepped with a 16.16 countdown of the destination pixels left for the current
+// one, so there are no divisions in the inner loop, and scale factors do not need to be integers.
+static void draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+
+    pixel_color_t bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = pixel_color_from_rgba8888(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int x_scale = item->x_scale;
+    int y_scale = item->y_scale;
+    if (UNLIKELY(x_scale <= 0 || y_scale <= 0)) {
+        return;
+    }
+
+    const struct ImageDataWithSize *img = &item->data.image_data_with_size;
+    int source_x = item->source_x;
+    int source_y = item->source_y;
+
+    int src_y = (int) (((int64_t) (ypos - y) << SCALE_SHIFT) / y_scale);
+    if (source_y + src_y >= img->height) {
+        return;
+    }
+
+    int width = item->width;
+    int max_width = scaled_extent(img->width, source_x, x_scale);
+    if (width > max_width) {
+        width = max_width;
+    }
+
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    int j = xpos - x;
+    if (j >= width) {
+        return;
+    }
+
+    int src_x = (int) (((int64_t) j << SCALE_SHIFT) / x_scale);
+    // always > 0: how much of source pixel src_x is still to be drawn after j
+    int32_t remaining = (int32_t) ((int64_t) (src_x + 1) * x_scale - ((int64_t) j << SCALE_SHIFT));
+
+    const struct ImageFormatData *format = &item->image_format;
+    const char *row = img->pix + (source_y + src_y) * format->stride;
+    int src = source_x + src_x;
+
+    int drawn_pixels = 0;
+
+    for (; j < width; j++) {
+        uint32_t img_pixel = image_read_row_pixel(format, row, src);
+        draw_image_pixel(line_buf, xpos + drawn_pixels, ypos, img_pixel, visible_bg, bgcolor);
+        drawn_pixels++;
+
+        remaining -= SCALE_ONE;
+        // more than one step only when scaling down
+        while (remaining <= 0) {
+            remaining += x_scale;
+            src++;
+        }
+    }
+}
+
+// Blends two RGBA8888 pixels, weight goes from 0 (only a) to 256 (only b). Two channels are
+// blended at once, so each multiplication handles 16 bits lanes.
+static inline uint32_t rgba8888_lerp(uint32_t a, uint32_t b, int weight)
+{
+    uint32_t even = (((a & 0x00FF00FF) * (256 - weight) + (b & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+    uint32_t odd = ((((a >> 8) & 0x00FF00FF) * (256 - weight) + ((b >> 8) & 0x00FF00FF) * weight) >> 8) & 0x00FF00FF;
+
+    return even | (odd << 8);
+}
+
+// Maps the center of destination pixel dst to source coordinates, as 16.16 fixed point.
+static inline int64_t scaled_source_center(int dst, int scale)
+{
+    return ((((int64_t) dst << SCALE_SHIFT) + SCALE_ONE / 2) << SCALE_SHIFT) / scale - SCALE_ONE / 2;
+}
+
+// Splits a 16.16 source coordinate into the two source pixels around it, clamped to [0, size),
+// and the weight of the second one.
+static inline void scaled_source_taps(int64_t pos, int size, int *first, int *second, int *weight)
+{
+    if (pos <= 0) {
+        *first = 0;
+        *second = 0;
+        *weight = 0;
+        return;
+    }
+
+    int index = pos >> SCALE_SHIFT;
+    if (index >= size - 1) {
+        *first = size - 1;
+        *second = size - 1;
+        *weight = 0;
+        return;
+    }
+
+    *first = index;
+    *second = index + 1;
+    *weight = (pos >> (SCALE_SHIFT - 8)) & 0xFF;
+}
+
+// Bilinear filtering: the two source rows are found once per span, then the source x coordinate
+// is stepped in 16.16 fixed point, so there are no divisions in the inner loop.
+static void draw_scaled_cropped_img_bilinear_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int y = item->y;
+
+    pixel_color_t bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = pixel_color_from_rgba8888(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
+    }
+
+    int x_scale = item->x_scale;
+    int y_scale = item->y_scale;
+    if (UNLIKELY(x_scale <= 0 || y_scale <= 0)) {
+        return;
+    }
+
+    const struct ImageDataWithSize *img = &item->data.image_data_with_size;
+    int source_x = item->source_x;
+    int source_y = item->source_y;
+    int source_width = img->width - source_x;
+    int source_height = img->height - source_y;
+
+    // same coverage of nearest filtering
+    if (((int64_t) (ypos - y) << SCALE_SHIFT) / y_scale >= source_height) {
+        return;
+    }
+
+    int width = item->width;
+    int max_width = scaled_extent(img->width, source_x, x_scale);
+    if (width > max_width) {
+        width = max_width;
+    }
+
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    int j = xpos - x;
+    if (j >= width) {
+        return;
+    }
+
+    int row0;
+    int row1;
+    int y_weight;
+    scaled_source_taps(scaled_source_center(ypos - y, y_scale), source_height, &row0, &row1, &y_weight);
+    const struct ImageFormatData *format = &item->image_format;
+    const char *top = img->pix + (source_y + row0) * format->stride;
+    const char *bottom = img->pix + (source_y + row1) * format->stride;
+
+    int64_t pos = scaled_source_center(j, x_scale);
+    int64_t step = ((int64_t) SCALE_ONE << SCALE_SHIFT) / x_scale;
+
+    int drawn_pixels = 0;
+
+    for (; j < width; j++) {
+        int col0;
+        int col1;
+        int x_weight;
+        scaled_source_taps(pos, source_width, &col0, &col1, &x_weight);
+        col0 += source_x;
+        col1 += source_x;
+
+        uint32_t upper = rgba8888_lerp(image_read_row_pixel(format, top, col0),
+            image_read_row_pixel(format, top, col1), x_weight);
+        uint32_t lower = rgba8888_lerp(image_read_row_pixel(format, bottom, col0),
+            image_read_row_pixel(format, bottom, col1), x_weight);
+        uint32_t img_pixel = rgba8888_lerp(upper, lower, y_weight);
+
+        draw_image_pixel(line_buf, xpos + drawn_pixels, ypos, img_pixel, visible_bg, bgcolor);
+        drawn_pixels++;
+        pos += step;
+    }
+}
 
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
+static void draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    int x = item->x;
+    int width = item->width;
+    pixel_color_t color = pixel_color_from_rgba8888(item->brcolor);
+
+    int drawn_pixels = 0;
+
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    for (int j = xpos - x; j < width; j++) {
+        pixel_write(line_buf, xpos + drawn_pixels, ypos, color);
+        drawn_pixels++;
+    }
+}
+
+#ifdef ENABLE_UFONT
+// Colors of the 16 coverage levels of a glyph, from bgcolor to fgcolor, in the panel format: the
+// ones of dithered panels are still RGBA8888, so anti-aliased edges are dithered too.
+static void text_coverage_lut_init(pixel_color_t lut[16], uint32_t fgcolor, uint32_t bgcolor)
+{
+    for (int coverage = 0; coverage < 16; coverage++) {
+        lut[coverage] = pixel_color_from_rgba8888(rgba8888_lerp(bgcolor, fgcolor, (coverage * 256 + 7) / 15));
+    }
+}
+
+// Coverage of glyphs over a transparent background is blended with the line buffer when the panel
+// supports it, otherwise glyph pixels that are at least half covered are drawn.
+static inline void draw_text_coverage_pixel(uint8_t *line_buf, int xpos, int ypos, pixel_color_t fgcolor,
+    uint8_t coverage)
+{
+    if (coverage == 15) {
+        pixel_write(line_buf, xpos, ypos, fgcolor);
+        return;
+    }
+
+#ifdef PIXEL_COMPOSITE
+    pixel_color_t below = pixel_read(line_buf, xpos, ypos);
+    pixel_write(line_buf, xpos, ypos, pixel_color_blend(fgcolor, below, coverage * 0x11));
+#else
+    if (coverage >= 8) {
+        pixel_write(line_buf, xpos, ypos, fgcolor);
+    }
+#endif
+}
+
+// Text spans are drawn a chunk of pixels at a time, from one coverage level per pixel.
+#define TEXT_COVERAGE_CHUNK 128
+
+// Draws len pixels of a text item from their coverage levels. Rendered text and text drawn glyph by
+// glyph both go through it, so they look the same. Over a visible background, coverage levels are
+// looked up in a table of blended colors, that is built at the first glyph pixel of the span.
+static void draw_text_coverage_span(uint8_t *line_buf, int xpos, int ypos, int len, const BaseDisplayItem *item,
+    const uint8_t *coverage, pixel_color_t lut[16], bool *lut_ready)
+{
+    const struct TextData *text_data = &item->data.text_data;
+
+    if (item->brcolor == 0) {
+        pixel_color_t fgcolor = pixel_color_from_rgba8888(text_data->fgcolor);
+        for (int i = 0; i < len; i++) {
+            if (coverage[i] != 0) {
+                draw_text_coverage_pixel(line_buf, xpos + i, ypos, fgcolor, coverage[i]);
+            }
+        }
+        return;
+    }
+
+    pixel_color_t bgcolor = pixel_color_from_rgba8888(item->brcolor);
+    for (int i = 0; i < len; i++) {
+        if (coverage[i] == 0) {
+            pixel_write(line_buf, xpos + i, ypos, bgcolor);
+            continue;
+        }
+        if (!*lut_ready) {
+            text_coverage_lut_init(lut, text_data->fgcolor, item->brcolor);
+            *lut_ready = true;
+        }
+        pixel_write(line_buf, xpos + i, ypos, lut[coverage[i]]);
+    }
+}
+
+#ifdef ENABLE_TEXT_CACHE
+// Text that was rasterized by text_cache_resolve is drawn by reading its coverage row, without any
+// glyph lookup.
+static void draw_rendered_text_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    const struct TextCacheEntry *rendered = item->data.text_data.rendered;
+    const uint8_t *row = rendered->coverage + (ypos - item->y) * rendered->stride;
+    pixel_color_t lut[16];
+    bool lut_ready = false;
+    uint8_t coverage[TEXT_COVERAGE_CHUNK];
+
+    for (int start = 0; start < len; start += TEXT_COVERAGE_CHUNK) {
+        int count = (len - start < TEXT_COVERAGE_CHUNK) ? len - start : TEXT_COVERAGE_CHUNK;
+        int x0 = xpos - item->x + start;
+        for (int i = 0; i < count; i++) {
+            int x = x0 + i;
+            coverage[i] = (x & 1) ? (row[x / 2] >> 4) : (row[x / 2] & 0xF);
         }
+        draw_text_coverage_span(line_buf, xpos + start, ypos, count, item, coverage, lut, &lut_ready);
+    }
+}
+#endif
+
+// Glyph of a ufont text item, placed relative to the item top left corner.
+struct UFontTextGlyph
+{
+    const EpdGlyph *glyph;
+    int x;
+    int y;
+    // fetched when a scanline crosses the glyph for the first time, then kept until the end of
+    // the frame
+    const uint8_t *bitmap;
+    bool missing;
+};
+
+// Glyphs of a ufont text item, that are looked up once per frame instead of once per scanline.
+struct UFontTextLayout
+{
+    const EpdFont *font;
+    UFontGlyphCache *glyph_cache;
+    struct Arena *arena;
+    int count;
+    struct UFontTextGlyph glyphs[];
+};
+
+static struct UFontTextLayout *ufont_text_layout_new(const BaseDisplayItem *item, UFontGlyphCache *glyph_cache,
+    struct Arena *arena)
+{
+    const struct TextData *text_data = &item->data.text_data;
+    const EpdFont *font = text_data->ufont;
+
+    // there is a glyph for each code point at most
+    int max_count = 0;
+    const char *text = text_data->text;
+    while (ufont_next_code_point(&text)) {
+        max_count++;
+    }
+
+    struct UFontTextLayout *layout = arena_alloc(arena,
+        sizeof(struct UFontTextLayout) + sizeof(struct UFontTextGlyph) * max_count);
+    if (IS_NULL_PTR(layout)) {
+        return NULL;
     }
+    layout->font = font;
+    layout->glyph_cache = glyph_cache;
+    layout->arena = arena;
+    layout->count = 0;
 
-    return line_len;
+    text = text_data->text;
+    int cursor_x = 0;
+    int baseline = text_data->baseline;
+    uint32_t cp;
+    while ((cp = ufont_next_code_point(&text))) {
+        if (cp == '\n') {
+            cursor_x = 0;
+            baseline += font->advance_y;
+            continue;
+        }
+
+        const EpdGlyph *glyph = epd_get_glyph(font, cp);
+        if (!glyph) {
+            // default fallback glyph
+            glyph = epd_get_glyph(font, 0);
+            if (!glyph) {
+                continue;
+            }
+        }
+
+        int glyph_x = cursor_x + glyph->left;
+        int glyph_y = baseline - glyph->top;
+        cursor_x += glyph->advance_x;
+        if (glyph->width == 0 || glyph->height == 0 || glyph_x >= item->width || glyph_x + glyph->width <= 0
+            || glyph_y >= item->height || glyph_y + glyph->height <= 0) {
+            continue;
+        }
+
+        struct UFontTextGlyph *placed = &layout->glyphs[layout->count];
+        placed->glyph = glyph;
+        placed->x = glyph_x;
+        placed->y = glyph_y;
+        placed->bitmap = NULL;
+        placed->missing = false;
+        layout->count++;
+    }
+
+    return layout;
 }
 
-static int draw_x(uint8_t *line_buf, int xpos, int ypos, BaseDisplayItem *items, int items_count)
+// Lays out the glyphs of text items that use a registered font, and that are not rendered by the
+// text cache. It must be called once per frame before drawing, layouts are allocated from the frame
+// arena and bitmaps are taken from the glyph cache of the display. Returns false when there is no
+// memory.
+static bool ufont_text_layout_resolve(BaseDisplayItem *items, int count, UFontGlyphCache *glyph_cache,
+    struct Arena *arena)
 {
-    bool below = false;
+    ufont_glyph_cache_next_frame(glyph_cache);
 
-    for (int i = 0; i < items_count; i++) {
+    for (int i = 0; i < count; i++) {
         BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
+        if (item->primitive != Text || !item->data.text_data.ufont) {
             continue;
         }
 
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
+        struct TextData *text_data = &item->data.text_data;
+        text_data->layout = NULL;
+#ifdef ENABLE_TEXT_CACHE
+        if (text_data->rendered) {
+            continue;
+        }
+#endif
+        text_data->layout = ufont_text_layout_new(item, glyph_cache, arena);
+        if (IS_NULL_PTR(text_data->layout)) {
+            return false;
+        }
+    }
 
-        int drawn_pixels = 0;
-        switch (items[i].primitive) {
-            case Image:
-                //fprintf(stderr, "Image\n");
-                drawn_pixels = draw_image_x(line_buf, xpos, ypos, max_line_len, item);
-                break;
+    return true;
+}
 
-            case ScaledCroppedImage:
-                //fprintf(stderr, "ScaledCroppedImage\n");
-                drawn_pixels = draw_scaled_cropped_img_x(line_buf, xpos, ypos, max_line_len, item);
-                break;
+// Bitmaps are valid until the end of the frame: the glyph cache keeps the ones it holds, and the
+// others are copied to the frame arena, so each glyph is inflated once per frame at most.
+static const uint8_t *ufont_text_glyph_bitmap(struct UFontTextLayout *layout, struct UFontTextGlyph *placed)
+{
+    if (placed->bitmap || placed->missing) {
+        return placed->bitmap;
+    }
 
-            case Rect:
-                //fprintf(stderr, "Rect\n");
-                drawn_pixels = draw_rect_x(line_buf, xpos, ypos, max_line_len, item);
-                break;
+    uint8_t *to_free;
+    const uint8_t *bitmap = ufont_glyph_bitmap(layout->glyph_cache, layout->font, placed->glyph, &to_free);
+    if (to_free) {
+        size_t size = (size_t) ((placed->glyph->width + 1) / 2) * placed->glyph->height;
+        uint8_t *copy = arena_alloc(layout->arena, size);
+        if (copy) {
+            memcpy(copy, bitmap, size);
+        }
+        free(to_free);
+        bitmap = copy;
+    }
 
-            case Text:
-                //fprintf(stderr, "Text\n");
-                drawn_pixels = draw_text_x(line_buf, xpos, ypos, max_line_len, item);
-                break;
+    placed->bitmap = bitmap;
+    placed->missing = IS_NULL_PTR(bitmap);
 
-            default: {
-                fprintf(stderr, "unexpected display list command.\n");
+    return bitmap;
+}
+
+// Glyphs that cross the scanline are merged into a row of coverage levels, keeping the highest one
+// where glyphs overlap, as text_cache_rasterize does.
+static void draw_ufont_text_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    struct UFontTextLayout *layout = item->data.text_data.layout;
+    int glyphs_count = layout ? layout->count : 0;
+    int y = ypos - item->y;
+    pixel_color_t lut[16];
+    bool lut_ready = false;
+    uint8_t coverage[TEXT_COVERAGE_CHUNK];
+
+    for (int start = 0; start < len; start += TEXT_COVERAGE_CHUNK) {
+        int count = (len - start < TEXT_COVERAGE_CHUNK) ? len - start : TEXT_COVERAGE_CHUNK;
+        // chunk relative to the item
+        int x0 = xpos - item->x + start;
+        int x1 = x0 + count;
+        memset(coverage, 0, count);
+
+        for (int g = 0; g < glyphs_count; g++) {
+            struct UFontTextGlyph *placed = &layout->glyphs[g];
+            const EpdGlyph *glyph = placed->glyph;
+            int glyph_y = y - placed->y;
+            if (glyph_y < 0 || glyph_y >= glyph->height || placed->x >= x1 || placed->x + glyph->width <= x0) {
+                continue;
+            }
+
+            const uint8_t *bitmap = ufont_text_glyph_bitmap(layout, placed);
+            if (IS_NULL_PTR(bitmap)) {
+                continue;
+            }
+            const uint8_t *row = bitmap + glyph_y * ((glyph->width + 1) / 2);
+
+            int first = (x0 > placed->x) ? x0 - placed->x : 0;
+            int last = (x1 - placed->x < glyph->width) ? x1 - placed->x : glyph->width;
+            uint8_t *out = coverage + placed->x - x0;
+            for (int i = first; i < last; i++) {
+                uint8_t level = (i & 1) ? (row[i / 2] >> 4) : (row[i / 2] & 0xF);
+                if (level > out[i]) {
+                    out[i] = level;
+                }
             }
         }
 
-        if (drawn_pixels != 0) {
-            return drawn_pixels;
+        draw_text_coverage_span(line_buf, xpos + start, ypos, count, item, coverage, lut, &lut_ready);
+    }
+}
+#endif
+
+static void draw_text_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+#ifdef ENABLE_UFONT
+    if (item->data.text_data.ufont) {
+#ifdef ENABLE_TEXT_CACHE
+        if (item->data.text_data.rendered) {
+            draw_rendered_text_x(line_buf, xpos, ypos, len, item);
+            return;
         }
+#endif
+        draw_ufont_text_x(line_buf, xpos, ypos, len, item);
+        return;
+    }
+#endif
 
-        below = true;
+    int x = item->x;
+    int y = item->y;
+    pixel_color_t fgcolor = pixel_color_from_rgba8888(item->data.text_data.fgcolor);
+    pixel_color_t bgcolor = 0;
+    bool visible_bg;
+    if (item->brcolor != 0) {
+        bgcolor = pixel_color_from_rgba8888(item->brcolor);
+        visible_bg = true;
+    } else {
+        visible_bg = false;
     }
 
-    return 1;
+    char *text = (char *) item->data.text_data.text;
+
+    int width = item->width;
+
+    int drawn_pixels = 0;
+
+    if (width > xpos - x + len) {
+        width = xpos - x + len;
+    }
+
+    for (int j = xpos - x; j < width; j++) {
+        int char_index = j / CHAR_WIDTH;
+        char c = text[char_index];
+        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
+
+        unsigned char row = glyph[ypos - y];
+
+        bool opaque;
+        int k = j % CHAR_WIDTH;
+        if (row & (1 << (7 - k))) {
+            opaque = true;
+        } else {
+            opaque = false;
+        }
+
+        if (opaque) {
+            pixel_write(line_buf, xpos + drawn_pixels, ypos, fgcolor);
+        } else if (visible_bg) {
+            pixel_write(line_buf, xpos + drawn_pixels, ypos, bgcolor);
+        }
+        drawn_pixels++;
+    }
+}
+
+// Rasterizers draw len pixels starting from xpos, and they leave untouched transparent pixels.
+static void draw_item_x(uint8_t *line_buf, int xpos, int ypos, int len, BaseDisplayItem *item)
+{
+    switch (item->primitive) {
+        case Image:
+#ifdef ENABLE_IMAGE_CACHE
+            if (item->data.image_data.native) {
+                draw_native_image_x(line_buf, xpos, ypos, len, item);
+                break;
+            }
+#endif
+            draw_image_x(line_buf, xpos, ypos, len, item);
+            break;
+
+        case ScaledCroppedImage:
+            if (item->filter == ScaleFilterBilinear) {
+                draw_scaled_cropped_img_bilinear_x(line_buf, xpos, ypos, len, item);
+            } else {
+                draw_scaled_cropped_img_x(line_buf, xpos, ypos, len, item);
+            }
+            break;
+
+        case Rect:
+            draw_rect_x(line_buf, xpos, ypos, len, item);
+            break;
+
+        case Text:
+            draw_text_x(line_buf, xpos, ypos, len, item);
+            break;
+
+        default: {
+            fprintf(stderr, "unexpected display list command.\n");
+        }
+    }
+}
+
+// Items below the topmost opaque one are never visible, the others are drawn bottom to top so
+// transparent pixels show what is below them.
+static void draw_row(uint8_t *line_buf, int ypos, struct ScanlineIndex *index, int x0, int x1)
+{
+    int spans_count = scanline_index_spans(index, x0, x1);
+
+    for (int i = 0; i < spans_count; i++) {
+        struct ScanlineSpan *span = &index->spans[i];
+        int len = span->x1 - span->x0;
+
+        for (int j = span->bottom; j >= span->top; j--) {
+            BaseDisplayItem *item = index->active[j];
+            if (scanline_span_is_covered_by(span, item)) {
+                draw_item_x(line_buf, span->x0, ypos, len, item);
+            }
+        }
+    }
 }
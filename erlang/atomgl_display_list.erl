@@ -0,0 +1,102 @@
+%
+% This file is part of AtomGL.
+%
+% Copyright 2024 Davide Bettio <davide@uninstall.it>
+%
+% Licensed under the Apache License, Version 2.0 (the "License");
+% you may not use this file except in compliance with the License.
+% You may obtain a copy of the License at
+%
+%    http://www.apache.org/licenses/LICENSE-2.0
+%
+% Unless required by applicable law or agreed to in writing, software
+% distributed under the License is distributed on an "AS IS" BASIS,
+% WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+% See the License for the specific language governing permissions and
+% limitations under the License.
+%
+% SPDX-License-Identifier: Apache-2.0
+%
+
+%% Encodes display lists into the packed format accepted by the update_bin command, that is
+%% decoded by the display driver in a single pass, without walking terms:
+%%
+%% {Bin, Images} = atomgl_display_list:encode(DisplayList),
+%% gen_server:call(Display, {update_bin, Bin, Images}).
+%%
+%% See display_list.h for the binary layout.
+-module(atomgl_display_list).
+-export([encode/1]).
+
+-define(VERSION, 1).
+-define(TRANSPARENT, 16#FFFFFFFF).
+-define(FONT_DEFAULT16PX, 0).
+-define(FILTER_NEAREST, 0).
+-define(FILTER_BILINEAR, 1).
+
+-define(RECT, 1).
+-define(TEXT, 2).
+-define(IMAGE, 3).
+-define(SCALED_CROPPED_IMAGE, 4).
+
+encode(DisplayList) ->
+    {Encoded, {Images, _ImagesCount}} = encode_items(DisplayList, [], {[], 0}),
+    Count = length(DisplayList),
+    Bin = iolist_to_binary([<<?VERSION:8, Count:16/little>> | Encoded]),
+    {Bin, list_to_tuple(lists:reverse(Images))}.
+
+encode_items([], Acc, Images) ->
+    {lists:reverse(Acc), Images};
+encode_items([Item | Tail], Acc, Images) ->
+    {Encoded, NewImages} = encode_item(Item, Images),
+    encode_items(Tail, [Encoded | Acc], NewImages).
+
+encode_item({rect, X, Y, Width, Height, Color}, Images) ->
+    {<<?RECT:8, X:16/little-signed, Y:16/little-signed, Width:16/little, Height:16/little,
+            Color:32/little>>,
+        Images};
+encode_item({text, X, Y, default16px, FgColor, BgColor, Text}, Images) ->
+    TextBin = erlang:iolist_to_binary(Text),
+    Len = byte_size(TextBin),
+    {<<?TEXT:8, X:16/little-signed, Y:16/little-signed, ?FONT_DEFAULT16PX:8, FgColor:32/little,
+            (color(BgColor)):32/little, Len:16/little, TextBin/binary>>,
+        Images};
+encode_item({image, X, Y, BgColor, Image}, Images) ->
+    {Index, NewImages} = add_image(Image, Images),
+    {<<?IMAGE:8, X:16/little-signed, Y:16/little-signed, (color(BgColor)):32/little,
+            Index:16/little>>,
+        NewImages};
+encode_item(
+    {scaled_cropped_image, X, Y, Width, Height, BgColor, SourceX, SourceY, XScale, YScale, Opts,
+        Image},
+    Images
+) ->
+    {Index, NewImages} = add_image(Image, Images),
+    {FixedXScale, FixedYScale} =
+        case lists:keyfind(scale, 1, Opts) of
+            {scale, XRational, YRational} -> {scale(XRational), scale(YRational)};
+            false -> {scale(XScale), scale(YScale)}
+        end,
+    Filter = filter(proplists:get_value(filter, Opts, nearest)),
+    {<<?SCALED_CROPPED_IMAGE:8, X:16/little-signed, Y:16/little-signed, Width:16/little,
+            Height:16/little, (color(BgColor)):32/little, SourceX:16/little-signed,
+            SourceY:16/little-signed, FixedXScale:32/little, FixedYScale:32/little, Filter:8,
+            Index:16/little>>,
+        NewImages};
+encode_item(Item, _Images) ->
+    erlang:error(badarg, [Item]).
+
+add_image(Image, {Images, Count}) ->
+    {Count, {[Image | Images], Count + 1}}.
+
+% 16.16 fixed point
+scale({Num, Den}) when is_integer(Num) andalso is_integer(Den) andalso Num > 0 andalso Den > 0 ->
+    ((Num bsl 16) + (Den div 2)) div Den;
+scale(Scale) when is_integer(Scale) -> Scale bsl 16;
+scale(Scale) when is_float(Scale) -> round(Scale * 65536).
+
+filter(nearest) -> ?FILTER_NEAREST;
+filter(bilinear) -> ?FILTER_BILINEAR.
+
+color(transparent) -> ?TRANSPARENT;
+color(Color) when is_integer(Color) -> Color.
@@ -50,9 +50,25 @@
 
 #include "backlight_gpio.h"
 #include "display_common.h"
+#include "ufontlib.h"
+
+// fonts registered with register_font, text items look them up while they are parsed
+#define ENABLE_UFONT
+
 #include "display_items.h"
+#include "display_list.h"
+#include "damage.h"
+#include "scene.h"
 #include "spi_display.h"
 
+#include "rgb565.h"
+
+#define ENABLE_IMAGE_CACHE
+#include "image_cache.h"
+
+#define ENABLE_TEXT_CACHE
+#include "text_cache.h"
+
 #define SPI_CLOCK_HZ 27000000
 #define SPI_MODE 0
 
@@ -121,6 +137,22 @@ struct SPI
     avm_int_t rotation;
 
     Context *ctx;
+
+    struct DisplayAtoms atoms;
+    struct Arena arena;
+    // fonts registered with register_font
+    UFontManager *fonts;
+
+    // retained display list, and areas that have to be redrawn
+    struct Scene scene;
+    struct DamageRegion damage;
+
+    // images converted to the panel format
+    struct ImageCache image_cache;
+    // text items with registered fonts, rasterized once
+    struct TextCache text_cache;
+    // decompressed glyphs of registered fonts, used only by the task that draws this display
+    UFontGlyphCache *glyph_cache;
 };
 
 // This struct is just for compatibility reasons with the SDL display driver
@@ -135,43 +167,6 @@ struct Screen
 
 static struct Screen *screen;
 
-// This functions is taken from:
-// https://stackoverflow.com/questions/18937701/combining-two-16-bits-rgb-colors-with-alpha-blending
-static inline uint16_t alpha_blend_rgb565(uint32_t fg, uint32_t bg, uint8_t alpha)
-{
-    alpha = (alpha + 4) >> 3;
-    bg = (bg | (bg << 16)) & 0b00000111111000001111100000011111;
-    fg = (fg | (fg << 16)) & 0b00000111111000001111100000011111;
-    uint32_t result = ((((fg - bg) * alpha) >> 5) + bg) & 0b00000111111000001111100000011111;
-    return (uint16_t)((result >> 16) | result);
-}
-
-static inline uint8_t rgba8888_get_alpha(uint32_t color)
-{
-    return color & 0xFF;
-}
-
-static inline uint16_t rgba8888_color_to_rgb565(struct Screen *s, uint32_t color)
-{
-    uint8_t r = color >> 24;
-    uint8_t g = (color >> 16) & 0xFF;
-    uint8_t b = (color >> 8) & 0xFF;
-
-    return (((uint16_t)(r >> 3)) << 11) | (((uint16_t)(g >> 2)) << 5) | ((uint16_t) b >> 3);
-}
-
-static inline uint16_t rgb565_color_to_surface(struct Screen *s, uint16_t color16)
-{
-    return (uint16_t) SPI_SWAP_DATA_TX(color16, 16);
-}
-
-static inline uint16_t uint32_color_to_surface(struct Screen *s, uint32_t color)
-{
-    uint16_t color16 = rgba8888_color_to_rgb565(s, color);
-
-    return rgb565_color_to_surface(s, color16);
-}
-
 struct PendingReply
 {
     uint64_t pending_call_ref_ticks;
@@ -212,275 +207,19 @@ static inline void set_screen_paint_area(struct SPI *spi, int x, int y, int widt
     spi_device_release_bus(spi->spi_disp.handle);
 }
 
-static int draw_image_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    uint16_t bgcolor = 0;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = rgba8888_color_to_rgb565(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        uint8_t alpha = rgba8888_get_alpha(img_pixel);
-        if (alpha == 0xFF) {
-            uint16_t color = uint32_color_to_surface(screen, img_pixel);
-            pixmem16[drawn_pixels] = color;
-        } else if (visible_bg) {
-            uint16_t color = rgba8888_color_to_rgb565(screen, img_pixel);
-            uint16_t blended = alpha_blend_rgb565(color, bgcolor, alpha);
-            pixmem16[drawn_pixels] = rgb565_color_to_surface(screen, blended);
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
+#include "draw_common.h"
 
-    return drawn_pixels;
-}
-
-static int draw_scaled_cropped_img_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static void draw_damaged_rect(struct SPI *spi, struct ScanlineIndex *index, const struct DamageRect *rect)
 {
-    int x = item->x;
-    int y = item->y;
-
-    uint16_t bgcolor = 0;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = rgba8888_color_to_rgb565(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        uint8_t alpha = rgba8888_get_alpha(img_pixel);
-        if (alpha == 0xFF) {
-            uint16_t color = uint32_color_to_surface(screen, img_pixel);
-            pixmem16[drawn_pixels] = color;
-        } else if (visible_bg) {
-            uint16_t color = rgba8888_color_to_rgb565(screen, img_pixel);
-            uint16_t blended = alpha_blend_rgb565(color, bgcolor, alpha);
-            pixmem16[drawn_pixels] = rgb565_color_to_surface(screen, blended);
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        // TODO: optimize here
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_rect_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int width = item->width;
-    uint16_t color = uint32_color_to_surface(screen, item->brcolor);
-
-    int drawn_pixels = 0;
-
-    uint16_t *pixmem16 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        pixmem16[drawn_pixels] = color;
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_text_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-    uint16_t fgcolor = uint32_color_to_surface(screen, item->data.text_data.fgcolor);
-    uint16_t bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
-
-    uint16_t *pixmem32 = (uint16_t *) (((uint8_t *) screen->pixels) + xpos * sizeof(uint16_t));
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            pixmem32[drawn_pixels] = fgcolor;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
-{
-    int line_len = screen->w;
-
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
-
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
-        }
-    }
-
-    return line_len;
-}
-
-static int draw_x(int xpos, int ypos, BaseDisplayItem *items, int items_count)
-{
-    bool below = false;
-
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
-            continue;
-        }
-
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
-
-        int drawn_pixels = 0;
-        switch (items[i].primitive) {
-            case Image:
-                drawn_pixels = draw_image_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case Rect:
-                drawn_pixels = draw_rect_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case ScaledCroppedImage:
-                drawn_pixels = draw_scaled_cropped_img_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case Text:
-                drawn_pixels = draw_text_x(xpos, ypos, max_line_len, item);
-                break;
-            default: {
-                fprintf(stderr, "unexpected display list command.\n");
-            }
-        }
-
-        if (drawn_pixels != 0) {
-            return drawn_pixels;
-        }
-
-        below = true;
-    }
-
-    return 1;
-}
-
-static void do_update(Context *ctx, term display_list)
-{
-    int proper;
-    int len = term_list_length(display_list, &proper);
-
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
-
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
-    }
-
-    int screen_width = screen->w;
-    int screen_height = screen->h;
-    struct SPI *spi = ctx->platform_data;
-
-    set_screen_paint_area(spi, 0, 0, screen_width, screen_height);
+    set_screen_paint_area(spi, rect->x, rect->y, rect->width, rect->height);
     writecommand(spi, TFT_RAMWR);
     spi_device_acquire_bus(spi->spi_disp.handle, portMAX_DELAY);
 
     bool transaction_in_progress = false;
 
-    for (int ypos = 0; ypos < screen_height; ypos++) {
-        int xpos = 0;
-        while (xpos < screen_width) {
-            int drawn_pixels = draw_x(xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
+    for (int ypos = rect->y; ypos < rect->y + rect->height; ypos++) {
+        scanline_index_seek(index, ypos);
+        draw_row((uint8_t *) screen->pixels, ypos, index, rect->x, rect->x + rect->width);
 
         if (transaction_in_progress) {
             spi_transaction_t *trans;
@@ -493,7 +232,7 @@ static void do_update(Context *ctx, term display_list)
         void *tmp = screen->pixels;
         screen->pixels = screen->pixels_out;
         screen->pixels_out = tmp;
-        spi_display_dmawrite(&spi->spi_disp, screen_width * sizeof(uint16_t), screen->pixels_out);
+        spi_display_dmawrite(&spi->spi_disp, rect->width * sizeof(uint16_t), screen->pixels_out + rect->x);
         transaction_in_progress = true;
     }
 
@@ -503,8 +242,43 @@ static void do_update(Context *ctx, term display_list)
     }
 
     spi_device_release_bus(spi->spi_disp.handle);
+}
 
-    destroy_items(items, len);
+// Only areas touched by items that changed since the previous frame are rendered and sent, each
+// dirty rectangle through its own CASET/PASET window.
+static void draw_damaged(struct SPI *spi)
+{
+    struct Scene *scene = &spi->scene;
+
+    image_cache_resolve(&spi->image_cache, scene->items, scene->count);
+    text_cache_resolve(&spi->text_cache, scene->items, scene->count, spi->glyph_cache);
+    if (UNLIKELY(!ufont_text_layout_resolve(scene->items, scene->count, spi->glyph_cache, &spi->arena))) {
+        // damage is kept, so it is redrawn with next update
+        fprintf(stderr, "Failed to allocate text layouts.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
+
+    struct ScanlineIndex index;
+    if (UNLIKELY(!scanline_index_init(&index, scene->items, scene->count, &spi->arena))) {
+        // damage is kept, so it is redrawn with next update
+        fprintf(stderr, "Failed to allocate scanline index.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
+
+    for (int i = 0; i < spi->damage.rects_count; i++) {
+        struct DamageRect rect = spi->damage.rects[i];
+        // keep DMA buffers word aligned, redrawing one more column is harmless
+        rect.width += rect.x & 1;
+        rect.x &= ~1;
+
+        scanline_index_rewind(&index);
+        draw_damaged_rect(spi, &index, &rect);
+    }
+    damage_region_clear(&spi->damage);
+
+    arena_reset(&spi->arena);
 }
 
 void draw_buffer(struct SPI *spi, int x, int y, int width, int height, const void *imgdata)
@@ -543,7 +317,8 @@ void draw_buffer(struct SPI *spi, int x, int y, int width, int height, const voi
     free(tmpbuf);
 }
 
-static void process_message(Message *message, Context *ctx)
+// Returns true when the message is retained by the scene, so it must not be disposed.
+static bool process_message(Message *message, Context *ctx)
 {
     GenMessage gen_message;
     if (UNLIKELY(port_parse_gen_message(message->message, &gen_message) != GenCallMessage)) {
@@ -559,13 +334,12 @@ static void process_message(Message *message, Context *ctx)
 
     struct SPI *spi = ctx->platform_data;
 
-    if (cmd == context_make_atom(ctx, "\x6"
-                                      "update")) {
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+    bool retained = false;
 
-    } else if (cmd == context_make_atom(ctx, "\xB"
-                                             "draw_buffer")) {
+    if (scene_handle_command(&spi->scene, ctx, message, req, &spi->damage, &retained)) {
+        draw_damaged(spi);
+
+    } else if (cmd == spi->atoms.draw_buffer) {
         int x = term_to_int(term_get_tuple_element(req, 1));
         int y = term_to_int(term_get_tuple_element(req, 2));
         int width = term_to_int(term_get_tuple_element(req, 3));
@@ -576,9 +350,17 @@ static void process_message(Message *message, Context *ctx)
         const void *data = (const void *) ((addr_low | (addr_high << 16)));
 
         draw_buffer(spi, x, y, width, height, data);
+        // display list content has been overwritten
+        damage_region_mark_all(&spi->damage);
 
         // draw_buffer is a kind of cast, no need to reply
-        return;
+        return false;
+
+    } else if (cmd == spi->atoms.register_font) {
+        retained = display_items_register_font(spi->fonts, req);
+        if (!retained) {
+            fprintf(stderr, "display: failed to register font.\n");
+        }
 
     } else {
         fprintf(stderr, "display: ");
@@ -593,6 +375,8 @@ static void process_message(Message *message, Context *ctx)
 
     send_message(gen_message.pid, return_tuple, ctx->global);
     END_WITH_STACK_HEAP(heap, ctx->global);
+
+    return retained;
 }
 
 static void process_messages(void *arg)
@@ -602,11 +386,9 @@ static void process_messages(void *arg)
     while (true) {
         Message *message;
         xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
-        process_message(message, args->ctx);
-
-        BEGIN_WITH_STACK_HEAP(1, temp_heap);
-        mailbox_message_dispose(&message->base, &temp_heap);
-        END_WITH_STACK_HEAP(temp_heap, args->ctx->global);
+        if (!process_message(message, args->ctx)) {
+            destroy_message(message, args->ctx->global);
+        }
     }
 }
 
@@ -662,6 +444,12 @@ static void display_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    display_atoms_init(&spi->atoms, ctx->global);
+    arena_init(&spi->arena);
+    spi->fonts = ufont_manager_new();
+    scene_init(&spi->scene, ctx->global, &spi->atoms, spi->fonts);
+    damage_region_init(&spi->damage, screen->w, screen->h);
+    damage_region_mark_all(&spi->damage);
 
     struct SPIDisplayConfig spi_config;
     spi_display_init_config(&spi_config);
@@ -692,6 +480,22 @@ static void display_init(Context *ctx, term opts)
     ok = ok && ((invon == TRUE_ATOM) || (invon == FALSE_ATOM));
     bool enable_tft_invon = (invon == TRUE_ATOM);
 
+    term image_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "image_cache_size"),
+        term_from_int(image_cache_default_size()), ctx->global);
+    ok = ok && term_is_integer(image_cache_size) && term_to_int(image_cache_size) >= 0;
+    image_cache_init(&spi->image_cache, ctx->global, ok ? term_to_int(image_cache_size) : 0);
+
+    term glyph_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "glyph_cache_size"),
+        term_from_int(UFONT_GLYPH_CACHE_DEFAULT_BUDGET), ctx->global);
+    ok = ok && term_is_integer(glyph_cache_size) && term_to_int(glyph_cache_size) >= 0;
+    // without a cache glyphs are inflated each frame
+    spi->glyph_cache = ufont_glyph_cache_new(ok ? term_to_int(glyph_cache_size) : 0);
+
+    term text_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\xF", "text_cache_size"),
+        term_from_int(TEXT_CACHE_DEFAULT_SIZE), ctx->global);
+    ok = ok && term_is_integer(text_cache_size) && term_to_int(text_cache_size) >= 0;
+    text_cache_init(&spi->text_cache, ok ? term_to_int(text_cache_size) : 0);
+
     if (UNLIKELY(!ok)) {
         ESP_LOGE(TAG, "Failed init: invalid display parameters.");
         return;
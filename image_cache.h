@@ -0,0 +1,445 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _IMAGE_CACHE_H_
+#define _IMAGE_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <globalcontext.h>
+#include <refc_binary.h>
+#include <utils.h>
+
+#include "arena.h"
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+
+// display_items.h and the pixel traits of the target format must be included before this file.
+// Besides pixel_color_t and pixel_color_from_rgba8888, the cache uses:
+// - uint8_t pixel_alpha_from_image(uint32_t img_pixel): alpha as pixel_color_from_image sees it
+// - pixel_color_t pixel_color_blend(pixel_color_t fg, pixel_color_t bg, uint8_t alpha)
+// Drivers that use the cache define ENABLE_IMAGE_CACHE before including draw_common.h, and their
+// line buffer must be an array of pixel_color_t, since opaque rows are copied with memcpy.
+
+#define IMAGE_CACHE_DEFAULT_SIZE (32 * 1024)
+#define IMAGE_CACHE_PSRAM_DEFAULT_SIZE (256 * 1024)
+
+// Entries of binaries that are not in the scene anymore are released after this many frames,
+// otherwise the cache would keep them alive until they are evicted.
+#define IMAGE_CACHE_MAX_IDLE_FRAMES 32
+
+#define IMAGE_CACHE_BUCKETS 64
+
+enum ImageRunKind
+{
+    ImageRunOpaque,
+    ImageRunTransparent,
+    // pixels that need blending
+    ImageRunPartial
+};
+
+// Pixels of a row, from x up to the next run or the end of the row, that share the same kind.
+struct ImageRun
+{
+    uint16_t x;
+    uint16_t kind;
+};
+
+// Image converted to the native format of the panel, so it can be drawn without any conversion.
+struct ImageCacheEntry
+{
+    struct ImageCacheEntry *prev;
+    struct ImageCacheEntry *next;
+    // next entry with the same pix hash
+    struct ImageCacheEntry *bucket_next;
+
+    // key: pixels of the source binary and their format, the palette is copied at the end of the
+    // entry since the cache does not keep its binary alive
+    const char *pix;
+    struct ImageFormatData format;
+    // reference held by the cache, NULL for const binaries
+    struct RefcBinary *refc;
+    int width;
+    int height;
+
+    pixel_color_t *pixels;
+    // alpha of each pixel, it is NULL when no pixel is partially transparent
+    uint8_t *alpha;
+    // runs of row y go from runs[row_runs[y]] to runs[row_runs[y + 1]]
+    uint32_t *row_runs;
+    struct ImageRun *runs;
+
+    size_t size;
+    uint32_t last_used;
+};
+
+// LRU cache of native images, that is bounded by budget bytes. Entries are also indexed by the
+// address of their source pixels, so lookups do not walk the whole LRU list.
+struct ImageCache
+{
+    struct ImageCacheEntry *buckets[IMAGE_CACHE_BUCKETS];
+    // most recently used first
+    struct ImageCacheEntry *head;
+    struct ImageCacheEntry *tail;
+    size_t used;
+    size_t budget;
+    uint32_t frame;
+
+    GlobalContext *global;
+};
+
+// Returns the default budget, that is larger when there is PSRAM.
+static size_t image_cache_default_size()
+{
+#if defined(ESP_PLATFORM) && defined(MALLOC_CAP_SPIRAM)
+    if (heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0) {
+        return IMAGE_CACHE_PSRAM_DEFAULT_SIZE;
+    }
+#endif
+
+    return IMAGE_CACHE_DEFAULT_SIZE;
+}
+
+// Entries are not used for DMA, so PSRAM is preferred and internal RAM is left to line buffers.
+static void *image_cache_malloc(size_t size)
+{
+#if defined(ESP_PLATFORM) && defined(MALLOC_CAP_SPIRAM)
+    void *ptr = heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (ptr) {
+        return ptr;
+    }
+#endif
+
+    return malloc(size);
+}
+
+static void image_cache_init(struct ImageCache *cache, GlobalContext *global, size_t budget)
+{
+    for (int i = 0; i < IMAGE_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = NULL;
+    }
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->used = 0;
+    cache->budget = budget;
+    cache->frame = 0;
+    cache->global = global;
+}
+
+static inline unsigned int image_cache_bucket(const char *pix)
+{
+    // pixels of different binaries are at least a heap block apart
+    return ((uintptr_t) pix >> 4) % IMAGE_CACHE_BUCKETS;
+}
+
+static void image_cache_unlink(struct ImageCache *cache, struct ImageCacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void image_cache_push_front(struct ImageCache *cache, struct ImageCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void image_cache_release(struct ImageCache *cache, struct ImageCacheEntry *entry)
+{
+    struct ImageCacheEntry **bucket_entry = &cache->buckets[image_cache_bucket(entry->pix)];
+    while (*bucket_entry != entry) {
+        bucket_entry = &(*bucket_entry)->bucket_next;
+    }
+    *bucket_entry = entry->bucket_next;
+
+    image_cache_unlink(cache, entry);
+    cache->used -= entry->size;
+
+    if (entry->refc) {
+        refc_binary_decrement_refcount(entry->refc, cache->global);
+    }
+    free(entry);
+}
+
+static bool image_cache_entry_matches(const struct ImageCacheEntry *entry, const char *pix,
+    const struct ImageFormatData *format, int width, int height)
+{
+    return (entry->pix == pix) && (entry->width == width) && (entry->height == height)
+        && (entry->format.format == format->format) && (entry->format.stride == format->stride)
+        && (entry->format.color == format->color) && (entry->format.palette_len == format->palette_len)
+        && (format->palette_len == 0 || !memcmp(entry->format.palette, format->palette, format->palette_len * 4));
+}
+
+static struct ImageCacheEntry *image_cache_find(struct ImageCache *cache, const char *pix,
+    const struct ImageFormatData *format, int width, int height)
+{
+    for (struct ImageCacheEntry *entry = cache->buckets[image_cache_bucket(pix)]; entry; entry = entry->bucket_next) {
+        if (image_cache_entry_matches(entry, pix, format, width, height)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Evicts least recently used entries until size bytes are available. Entries used in the current
+// frame are never evicted, since items are pointing to them.
+static bool image_cache_make_room(struct ImageCache *cache, size_t size)
+{
+    if (size > cache->budget) {
+        return false;
+    }
+
+    while (cache->used + size > cache->budget) {
+        struct ImageCacheEntry *lru = cache->tail;
+        if (!lru || lru->last_used == cache->frame) {
+            return false;
+        }
+        image_cache_release(cache, lru);
+    }
+
+    return true;
+}
+
+static inline enum ImageRunKind image_run_kind(uint8_t alpha)
+{
+    switch (alpha) {
+        case 0xFF:
+            return ImageRunOpaque;
+        case 0:
+            return ImageRunTransparent;
+        default:
+            return ImageRunPartial;
+    }
+}
+
+// Counts the runs of the whole image, and tells if any pixel is partially transparent.
+static size_t image_cache_scan_runs(const char *pix, const struct ImageFormatData *format, int width,
+    int height, bool *partial)
+{
+    *partial = false;
+    if (image_format_is_opaque(format->format)) {
+        return height;
+    }
+
+    size_t runs_count = 0;
+
+    for (int y = 0; y < height; y++) {
+        enum ImageRunKind current = ImageRunOpaque;
+        for (int x = 0; x < width; x++) {
+            enum ImageRunKind kind = image_run_kind(pixel_alpha_from_image(image_read_pixel(format, pix, x, y)));
+            if (x == 0 || kind != current) {
+                runs_count++;
+                current = kind;
+            }
+            *partial = *partial || (kind == ImageRunPartial);
+        }
+    }
+
+    return runs_count;
+}
+
+static struct ImageCacheEntry *image_cache_create(struct ImageCache *cache, const struct ImageData *data,
+    const struct ImageFormatData *format, int width, int height)
+{
+    // runs start is 16 bits
+    if (width <= 0 || height <= 0 || width > UINT16_MAX) {
+        return NULL;
+    }
+
+    size_t pixels_count = (size_t) width * height;
+    // do not scan images that would not fit anyway
+    if (pixels_count * sizeof(pixel_color_t) > cache->budget) {
+        return NULL;
+    }
+    bool partial;
+    size_t runs_count = image_cache_scan_runs(data->pix, format, width, height, &partial);
+
+    size_t pixels_size = arena_align(pixels_count * sizeof(pixel_color_t));
+    size_t row_runs_size = (height + 1) * sizeof(uint32_t);
+    size_t runs_size = runs_count * sizeof(struct ImageRun);
+    size_t alpha_size = partial ? pixels_count : 0;
+    size_t palette_size = format->palette_len * 4;
+    size_t size = arena_align(sizeof(struct ImageCacheEntry)) + pixels_size + row_runs_size + runs_size
+        + alpha_size + palette_size;
+    if (!image_cache_make_room(cache, size)) {
+        return NULL;
+    }
+
+    uint8_t *block = image_cache_malloc(size);
+    if (IS_NULL_PTR(block)) {
+        return NULL;
+    }
+
+    struct ImageCacheEntry *entry = (struct ImageCacheEntry *) block;
+    entry->pix = data->pix;
+    entry->format = *format;
+    entry->refc = data->refc;
+    entry->width = width;
+    entry->height = height;
+    block += arena_align(sizeof(struct ImageCacheEntry));
+    entry->pixels = (pixel_color_t *) block;
+    block += pixels_size;
+    entry->row_runs = (uint32_t *) block;
+    block += row_runs_size;
+    entry->runs = (struct ImageRun *) block;
+    block += runs_size;
+    entry->alpha = partial ? block : NULL;
+    block += alpha_size;
+    entry->size = size;
+    entry->last_used = cache->frame;
+
+    if (palette_size > 0) {
+        memcpy(block, format->palette, palette_size);
+        entry->format.palette = (const char *) block;
+    }
+
+    const char *pix = data->pix;
+    uint32_t run = 0;
+    for (int y = 0; y < height; y++) {
+        entry->row_runs[y] = run;
+        for (int x = 0; x < width; x++) {
+            int i = y * width + x;
+            uint32_t img_pixel = image_read_pixel(format, pix, x, y);
+            uint8_t alpha = pixel_alpha_from_image(img_pixel);
+            entry->pixels[i] = pixel_color_from_rgba8888(img_pixel);
+            if (partial) {
+                entry->alpha[i] = alpha;
+            }
+
+            enum ImageRunKind kind = image_run_kind(alpha);
+            if (x == 0 || kind != entry->runs[run - 1].kind) {
+                entry->runs[run].x = x;
+                entry->runs[run].kind = kind;
+                run++;
+            }
+        }
+    }
+    entry->row_runs[height] = run;
+
+    if (entry->refc) {
+        refc_binary_increment_refcount(entry->refc);
+    }
+    cache->used += size;
+    image_cache_push_front(cache, entry);
+    unsigned int bucket = image_cache_bucket(entry->pix);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+
+    return entry;
+}
+
+// Returns the run of row y that contains pixel x.
+static inline const struct ImageRun *image_cache_entry_find_run(const struct ImageCacheEntry *entry, int x, int y)
+{
+    uint32_t first = entry->row_runs[y];
+    uint32_t last = entry->row_runs[y + 1] - 1;
+
+    while (first < last) {
+        uint32_t middle = (first + last + 1) / 2;
+        if (entry->runs[middle].x <= x) {
+            first = middle;
+        } else {
+            last = middle - 1;
+        }
+    }
+
+    return &entry->runs[first];
+}
+
+// Looks up the native copy of every image item, converting images that are not in the cache yet.
+// It must be called once per frame, before drawing: native pointers are valid until next call.
+// Items without a native copy are drawn from their RGBA8888 pixels.
+static void image_cache_resolve(struct ImageCache *cache, BaseDisplayItem *items, int count)
+{
+    cache->frame++;
+
+    for (int i = 0; i < count; i++) {
+        BaseDisplayItem *item = &items[i];
+        if (item->primitive != Image) {
+            continue;
+        }
+
+        struct ImageData *data = &item->data.image_data;
+        data->native = NULL;
+        if (!data->cacheable || cache->budget == 0) {
+            continue;
+        }
+#ifdef PIXEL_NATIVE_RGB565_BE
+        if (item->image_format.format == ImageFormatRGB565BE) {
+            // already in the native format
+            continue;
+        }
+#endif
+
+        struct ImageCacheEntry *entry = image_cache_find(cache, data->pix, &item->image_format, item->width, item->height);
+        if (entry) {
+            image_cache_unlink(cache, entry);
+            image_cache_push_front(cache, entry);
+        } else {
+            entry = image_cache_create(cache, data, &item->image_format, item->width, item->height);
+            if (!entry) {
+                continue;
+            }
+        }
+
+        entry->last_used = cache->frame;
+        data->native = entry;
+    }
+
+    struct ImageCacheEntry *entry = cache->tail;
+    while (entry && cache->frame - entry->last_used > IMAGE_CACHE_MAX_IDLE_FRAMES) {
+        struct ImageCacheEntry *prev = entry->prev;
+        if (entry->refc) {
+            image_cache_release(cache, entry);
+        }
+        entry = prev;
+    }
+}
+
+static void image_cache_destroy(struct ImageCache *cache)
+{
+    while (cache->head) {
+        image_cache_release(cache, cache->head);
+    }
+}
+
+#endif
@@ -20,36 +20,681 @@
 
 #include "image_helpers.h"
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atom.h>
+#include <defaultatoms.h>
+#include <globalcontext.h>
+#include <interop.h>
+#include <mailbox.h>
+#include <utils.h>
+
 #include "spng.h"
 
-void handle_load_image(term req, term ref, term pid, Context *ctx)
+enum LoadImageFormat
+{
+    LoadImageRGBA8888,
+    LoadImageRGB565,
+    LoadImageRGB565BE,
+    LoadImageL8
+};
+
+// spng keeps the previous and the current scanline, and a deinterlaced row, up to 8 bytes per pixel
+#define LOAD_IMAGE_SPNG_ROWS 3
+#define LOAD_IMAGE_SPNG_ROW_PIXEL_SIZE 8
+
+// an eighth of the decode budget is reserved to ancillary chunks (text, ICC profiles...), that spng
+// inflates and keeps until the context is freed
+#define LOAD_IMAGE_CHUNKS_BUDGET_DIVISOR 8
+
+// largest downscale factor, box sums of 255 * 255 * LOAD_IMAGE_MAX_SCALE^2 must fit 32 bits
+#define LOAD_IMAGE_MAX_SCALE 256
+
+// Adam7 passes, used to convert only the pixels that spng_decode_row wrote
+static const uint8_t adam7_x_start[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const uint8_t adam7_x_delta[7] = { 8, 8, 4, 4, 2, 2, 1 };
+
+// A load_image request waiting for a worker, message owns req, ref, pid and the PNG binary
+struct LoadImageJob
+{
+    struct LoadImageJob *next;
+    Message *message;
+    term req;
+    term ref;
+    term pid;
+    size_t budget;
+};
+
+struct ImageDecoder
+{
+    GlobalContext *global;
+    pthread_mutex_t mutex;
+    pthread_cond_t job_ready;
+    // FIFO queue, up to IMAGE_DECODER_MAX_QUEUED jobs
+    struct LoadImageJob *first;
+    struct LoadImageJob *last;
+    int queued;
+};
+
+static int load_image_pixel_size(enum LoadImageFormat format)
+{
+    switch (format) {
+        case LoadImageRGB565:
+        case LoadImageRGB565BE:
+            return 2;
+        case LoadImageL8:
+            return 1;
+        default:
+            return 4;
+    }
+}
+
+static void load_image_convert_pixel(const uint8_t *rgba, uint8_t *out, enum LoadImageFormat format)
+{
+    switch (format) {
+        case LoadImageRGB565:
+        case LoadImageRGB565BE: {
+            uint16_t color = ((rgba[0] >> 3) << 11) | ((rgba[1] >> 2) << 5) | (rgba[2] >> 3);
+            if (format == LoadImageRGB565) {
+                out[0] = color & 0xFF;
+                out[1] = color >> 8;
+            } else {
+                out[0] = color >> 8;
+                out[1] = color & 0xFF;
+            }
+            break;
+        }
+
+        case LoadImageL8:
+            out[0] = (rgba[0] * 77 + rgba[1] * 150 + rgba[2] * 29) >> 8;
+            break;
+
+        default:
+            memcpy(out, rgba, 4);
+            break;
+    }
+}
+
+// Source rectangle that is decoded, and the box downscale factor that is applied to it.
+struct LoadImageGeometry
+{
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+    uint32_t scale;
+    uint32_t out_width;
+    uint32_t out_height;
+};
+
+// Sums of a box of source pixels, colors are weighted by alpha
+struct LoadImageBoxSum
+{
+    uint32_t r;
+    uint32_t g;
+    uint32_t b;
+    uint32_t a;
+};
+
+static inline bool load_image_geometry_is_full(const struct LoadImageGeometry *geometry, uint32_t width,
+    uint32_t height)
+{
+    return geometry->x == 0 && geometry->y == 0 && geometry->width == width && geometry->height == height
+        && geometry->scale == 1;
+}
+
+static void load_image_box_add(struct LoadImageBoxSum *sum, const uint8_t *rgba)
+{
+    sum->r += rgba[0] * rgba[3];
+    sum->g += rgba[1] * rgba[3];
+    sum->b += rgba[2] * rgba[3];
+    sum->a += rgba[3];
+}
+
+// Converts a row of box sums, out_y selects how many source rows are in the boxes.
+static void load_image_box_row(const struct LoadImageBoxSum *sums, uint8_t *out,
+    const struct LoadImageGeometry *geometry, uint32_t out_y, enum LoadImageFormat format)
+{
+    int pixel_size = load_image_pixel_size(format);
+    uint32_t scale = geometry->scale;
+    uint32_t box_height = geometry->height - out_y * scale;
+    if (box_height > scale) {
+        box_height = scale;
+    }
+
+    for (uint32_t out_x = 0; out_x < geometry->out_width; out_x++) {
+        const struct LoadImageBoxSum *sum = &sums[out_x];
+        uint32_t box_width = geometry->width - out_x * scale;
+        if (box_width > scale) {
+            box_width = scale;
+        }
+        uint32_t count = box_width * box_height;
+
+        uint8_t rgba[4] = { 0, 0, 0, 0 };
+        if (sum->a != 0) {
+            rgba[0] = sum->r / sum->a;
+            rgba[1] = sum->g / sum->a;
+            rgba[2] = sum->b / sum->a;
+            rgba[3] = (sum->a + count / 2) / count;
+        }
+        load_image_convert_pixel(rgba, out + out_x * pixel_size, format);
+    }
+}
+
+// RGBA8 rows are decoded straight into the output binary when the image is taken as it is.
+static inline bool load_image_is_direct(const struct LoadImageGeometry *geometry, uint32_t width,
+    uint32_t height, enum LoadImageFormat format)
+{
+    return format == LoadImageRGBA8888 && load_image_geometry_is_full(geometry, width, height);
+}
+
+static inline size_t load_image_sums_count(const struct LoadImageGeometry *geometry, bool interlaced)
+{
+    if (geometry->scale == 1) {
+        return 0;
+    }
+
+    return (interlaced ? (size_t) geometry->out_height : 1) * geometry->out_width;
+}
+
+// Estimates the memory required by decode_png_rows, out_size included. Returns false when it
+// does not even fit a size_t.
+static bool load_image_working_size(const struct LoadImageGeometry *geometry, uint32_t width,
+    uint32_t height, size_t rgba_row_size, enum LoadImageFormat format, bool interlaced, size_t *size)
+{
+    size_t pixel_size = load_image_pixel_size(format);
+    if (geometry->out_width > SIZE_MAX / pixel_size / geometry->out_height
+        || width > SIZE_MAX / LOAD_IMAGE_SPNG_ROW_PIXEL_SIZE / LOAD_IMAGE_SPNG_ROWS) {
+        return false;
+    }
+    size_t out_size = (size_t) geometry->out_width * geometry->out_height * pixel_size;
+    size_t spng_size = (size_t) width * LOAD_IMAGE_SPNG_ROW_PIXEL_SIZE * LOAD_IMAGE_SPNG_ROWS;
+    size_t rgba_size = load_image_is_direct(geometry, width, height, format) ? 0 : rgba_row_size;
+    size_t sums_count = load_image_sums_count(geometry, interlaced);
+    if (sums_count > SIZE_MAX / sizeof(struct LoadImageBoxSum)) {
+        return false;
+    }
+    size_t sums_size = sums_count * sizeof(struct LoadImageBoxSum);
+
+    *size = out_size;
+    size_t parts[] = { spng_size, rgba_size, sums_size };
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        if (*size > SIZE_MAX - parts[i]) {
+            return false;
+        }
+        *size += parts[i];
+    }
+
+    return true;
+}
+
+// Decodes one row at a time: when the whole image is taken as it is, RGBA8 rows are decoded
+// straight into the output binary, otherwise the pixels inside the geometry rectangle are
+// converted from a single RGBA8 row, so the whole RGBA8 image is never allocated.
+// Downscaled pixels are the average of scale x scale boxes, that are summed row by row, except
+// for interlaced images, where the sums of the whole output image are kept until the last pass.
+static int decode_png_rows(spng_ctx *png_ctx, uint8_t *out, uint32_t width, uint32_t height,
+    size_t rgba_row_size, const struct LoadImageGeometry *geometry, enum LoadImageFormat format,
+    bool interlaced)
+{
+    int pixel_size = load_image_pixel_size(format);
+    size_t out_row_size = (size_t) geometry->out_width * pixel_size;
+    bool direct = load_image_is_direct(geometry, width, height, format);
+    uint32_t scale = geometry->scale;
+
+    uint8_t *rgba_row = NULL;
+    if (!direct) {
+        rgba_row = malloc(rgba_row_size);
+        if (IS_NULL_PTR(rgba_row)) {
+            return SPNG_EMEM;
+        }
+    }
+
+    struct LoadImageBoxSum *sums = NULL;
+    if (scale > 1) {
+        sums = calloc(load_image_sums_count(geometry, interlaced), sizeof(struct LoadImageBoxSum));
+        if (IS_NULL_PTR(sums)) {
+            free(rgba_row);
+            return SPNG_EMEM;
+        }
+    }
+
+    int ret = spng_decode_image(png_ctx, NULL, 0, SPNG_FMT_RGBA8, SPNG_DECODE_TRNS | SPNG_DECODE_PROGRESSIVE);
+    if (ret) {
+        free(sums);
+        free(rgba_row);
+        return ret;
+    }
+
+    uint32_t y_end = geometry->y + geometry->height;
+    uint32_t x_end = geometry->x + geometry->width;
+
+    struct spng_row_info row_info;
+    do {
+        ret = spng_get_row_info(png_ctx, &row_info);
+        if (ret) {
+            break;
+        }
+        uint32_t row_num = row_info.row_num;
+
+        if (direct) {
+            // interlaced passes fill in the pixels of rows that are already in place
+            ret = spng_decode_row(png_ctx, out + (size_t) row_num * out_row_size, rgba_row_size);
+            continue;
+        }
+
+        // rows above the rectangle still have to be decoded, since the stream is sequential
+        ret = spng_decode_row(png_ctx, rgba_row, rgba_row_size);
+        if ((ret && ret != SPNG_EOI) || row_num < geometry->y || row_num >= y_end) {
+            continue;
+        }
+
+        uint32_t x_start = interlaced ? adam7_x_start[row_info.pass] : 0;
+        uint32_t x_delta = interlaced ? adam7_x_delta[row_info.pass] : 1;
+        if (x_start < geometry->x) {
+            x_start += (geometry->x - x_start + x_delta - 1) / x_delta * x_delta;
+        }
+        uint32_t y = row_num - geometry->y;
+
+        if (scale == 1) {
+            uint8_t *out_row = out + (size_t) y * out_row_size;
+            for (uint32_t x = x_start; x < x_end; x += x_delta) {
+                load_image_convert_pixel(rgba_row + x * 4, out_row + (x - geometry->x) * pixel_size, format);
+            }
+        } else {
+            uint32_t out_y = y / scale;
+            struct LoadImageBoxSum *sums_row = sums + (interlaced ? (size_t) out_y * geometry->out_width : 0);
+            for (uint32_t x = x_start; x < x_end; x += x_delta) {
+                load_image_box_add(&sums_row[(x - geometry->x) / scale], rgba_row + x * 4);
+            }
+
+            if (!interlaced && (y % scale == scale - 1 || row_num == y_end - 1)) {
+                load_image_box_row(sums_row, out + (size_t) out_y * out_row_size, geometry, out_y, format);
+                memset(sums_row, 0, geometry->out_width * sizeof(struct LoadImageBoxSum));
+            }
+        }
+
+        // rows below the rectangle are not needed, unless later passes are still to come
+        if (!interlaced && row_num == y_end - 1) {
+            ret = SPNG_EOI;
+        }
+    } while (!ret);
+
+    if (ret == SPNG_EOI && interlaced && scale > 1) {
+        for (uint32_t out_y = 0; out_y < geometry->out_height; out_y++) {
+            load_image_box_row(sums + (size_t) out_y * geometry->out_width, out + (size_t) out_y * out_row_size,
+                geometry, out_y, format);
+        }
+    }
+
+    free(sums);
+    free(rgba_row);
+
+    return (ret == SPNG_EOI) ? 0 : ret;
+}
+
+static void send_load_image_reply(term ref, term pid, term reply, Heap *heap, GlobalContext *glb)
+{
+    term return_tuple = term_alloc_tuple(2, heap);
+    term_put_tuple_element(return_tuple, 0, ref);
+    term_put_tuple_element(return_tuple, 1, reply);
+
+    int local_process_id = term_to_local_process_id(pid);
+    globalcontext_send_message(glb, local_process_id, return_tuple);
+}
+
+static void send_load_image_error(term ref, term pid, AtomString reason, GlobalContext *glb)
+{
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) * 2, heap);
+
+    term error_tuple = term_alloc_tuple(2, &heap);
+    term_put_tuple_element(error_tuple, 0, ERROR_ATOM);
+    term_put_tuple_element(error_tuple, 1, globalcontext_make_atom(glb, reason));
+    send_load_image_reply(ref, pid, error_tuple, &heap, glb);
+
+    END_WITH_STACK_HEAP(heap, glb)
+}
+
+static term load_image_opt(term opts, term key, int arity)
 {
+    while (term_is_nonempty_list(opts)) {
+        term opt = term_get_list_head(opts);
+        if (term_is_tuple(opt) && term_get_tuple_arity(opt) == arity && term_get_tuple_element(opt, 0) == key) {
+            return opt;
+        }
+        opts = term_get_list_tail(opts);
+    }
+
+    return term_invalid_term();
+}
+
+static inline bool load_image_opt_int(term opt, int index, avm_int_t min, avm_int_t *value)
+{
+    term t = term_get_tuple_element(opt, index);
+    if (!term_is_integer(t) || term_to_int(t) < min) {
+        return false;
+    }
+    *value = term_to_int(t);
+
+    return true;
+}
+
+static inline uint32_t div_round_up(uint32_t n, uint32_t d)
+{
+    return (n + d - 1) / d;
+}
+
+// {crop, X, Y, W, H} is clipped to the image, {scale, {1, N}} shrinks it N times, and
+// {max_size, W, H} picks the smallest N that makes it fit, the largest N is used when both are set.
+static bool load_image_geometry_init(struct LoadImageGeometry *geometry, term opts, uint32_t width,
+    uint32_t height, GlobalContext *glb)
+{
+    geometry->x = 0;
+    geometry->y = 0;
+    geometry->width = width;
+    geometry->height = height;
+    geometry->scale = 1;
+
+    term crop = load_image_opt(opts, globalcontext_make_atom(glb, ATOM_STR("\x4", "crop")), 5);
+    if (!term_is_invalid_term(crop)) {
+        avm_int_t x, y, w, h;
+        if (!load_image_opt_int(crop, 1, 0, &x) || !load_image_opt_int(crop, 2, 0, &y)
+            || !load_image_opt_int(crop, 3, 1, &w) || !load_image_opt_int(crop, 4, 1, &h)
+            || x >= (avm_int_t) width || y >= (avm_int_t) height) {
+            return false;
+        }
+        geometry->x = x;
+        geometry->y = y;
+        geometry->width = (w < (avm_int_t) width - x) ? w : (avm_int_t) width - x;
+        geometry->height = (h < (avm_int_t) height - y) ? h : (avm_int_t) height - y;
+    }
+
+    term scale = load_image_opt(opts, globalcontext_make_atom(glb, ATOM_STR("\x5", "scale")), 2);
+    if (!term_is_invalid_term(scale)) {
+        term ratio = term_get_tuple_element(scale, 1);
+        avm_int_t num, den;
+        if (!term_is_tuple(ratio) || term_get_tuple_arity(ratio) != 2 || !load_image_opt_int(ratio, 0, 1, &num)
+            || num != 1 || !load_image_opt_int(ratio, 1, 1, &den) || den > LOAD_IMAGE_MAX_SCALE) {
+            return false;
+        }
+        geometry->scale = den;
+    }
+
+    term max_size = load_image_opt(opts, globalcontext_make_atom(glb, ATOM_STR("\x8", "max_size")), 3);
+    if (!term_is_invalid_term(max_size)) {
+        avm_int_t max_w, max_h;
+        if (!load_image_opt_int(max_size, 1, 1, &max_w) || !load_image_opt_int(max_size, 2, 1, &max_h)) {
+            return false;
+        }
+        uint32_t scale_x = (max_w < (avm_int_t) geometry->width) ? div_round_up(geometry->width, max_w) : 1;
+        uint32_t scale_y = (max_h < (avm_int_t) geometry->height) ? div_round_up(geometry->height, max_h) : 1;
+        uint32_t fit_scale = (scale_x > scale_y) ? scale_x : scale_y;
+        if (fit_scale > LOAD_IMAGE_MAX_SCALE) {
+            return false;
+        }
+        if (fit_scale > geometry->scale) {
+            geometry->scale = fit_scale;
+        }
+    }
+
+    geometry->out_width = div_round_up(geometry->width, geometry->scale);
+    geometry->out_height = div_round_up(geometry->height, geometry->scale);
+
+    return true;
+}
+
+static AtomString load_image_error_reason(int ret)
+{
+    switch (ret) {
+        case SPNG_EMEM:
+            return ATOM_STR("\x9", "no_memory");
+        case SPNG_EUSER_WIDTH:
+        case SPNG_EUSER_HEIGHT:
+        case SPNG_ECHUNK_LIMITS:
+        case SPNG_EOVERFLOW:
+            return ATOM_STR("\x9", "too_large");
+        default:
+            return ATOM_STR("\xB", "invalid_png");
+    }
+}
+
+// {load_image, Png} replies {Ref, RGBA8888Pixels}, while {load_image, Png, Opts} replies
+// {Ref, {Format, Width, Height, Pixels}}, where Format is set with {format, rgba8888 | rgb565 |
+// rgb565_be | l8}. rgb565 and l8 drop the alpha channel. Opts can also crop and downscale the
+// image while it is decoded, see load_image_geometry_init. Errors are replied as
+// {Ref, {error, Reason}}.
+//
+// Images that would take more than budget bytes to decode are refused with too_large, before
+// anything big is allocated. Part of the budget is reserved to the ancillary chunks that spng keeps,
+// the rest is left to the decode.
+static void load_image(term req, term ref, term pid, size_t budget, GlobalContext *glb)
+{
+    int arity = term_get_tuple_arity(req);
     term image_bin = term_get_tuple_element(req, 1);
-    const void *buf = term_binary_data(image_bin);
-    size_t buf_size = term_binary_size(image_bin);
+    if ((arity != 2 && arity != 3) || !term_is_binary(image_bin)) {
+        send_load_image_error(ref, pid, ATOM_STR("\x6", "badarg"), glb);
+        return;
+    }
+
+    term format_atom = globalcontext_make_atom(glb, ATOM_STR("\x8", "rgba8888"));
+    enum LoadImageFormat format = LoadImageRGBA8888;
+    if (arity == 3) {
+        term opts = term_get_tuple_element(req, 2);
+        format_atom = interop_kv_get_value_default(opts, ATOM_STR("\x6", "format"), format_atom, glb);
+        if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x6", "rgb565"))) {
+            format = LoadImageRGB565;
+        } else if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x9", "rgb565_be"))) {
+            format = LoadImageRGB565BE;
+        } else if (format_atom == globalcontext_make_atom(glb, ATOM_STR("\x2", "l8"))) {
+            format = LoadImageL8;
+        } else if (format_atom != globalcontext_make_atom(glb, ATOM_STR("\x8", "rgba8888"))) {
+            send_load_image_error(ref, pid, ATOM_STR("\x6", "badarg"), glb);
+            return;
+        }
+    }
 
     spng_ctx *png_ctx = spng_ctx_new(0);
-    spng_set_png_buffer(png_ctx, buf, buf_size);
+    if (IS_NULL_PTR(png_ctx)) {
+        send_load_image_error(ref, pid, ATOM_STR("\x9", "no_memory"), glb);
+        return;
+    }
 
-    size_t out_size;
-    spng_decoded_image_size(png_ctx, SPNG_FMT_RGBA8, &out_size);
+    size_t chunks_budget = budget / LOAD_IMAGE_CHUNKS_BUDGET_DIVISOR;
+    budget -= chunks_budget;
+    // at least an RGBA8 row must fit the budget, spng limits are 31 bits
+    size_t limit = budget > INT32_MAX ? INT32_MAX : budget;
+    size_t chunks_limit = chunks_budget > INT32_MAX ? INT32_MAX : chunks_budget;
+    struct spng_ihdr ihdr;
+    size_t rgba_size;
+    int ret = spng_set_image_limits(png_ctx, limit / 4, limit / 4);
+    if (!ret) {
+        ret = spng_set_chunk_limits(png_ctx, chunks_limit, chunks_limit);
+    }
+    if (!ret) {
+        ret = spng_set_png_buffer(png_ctx, term_binary_data(image_bin), term_binary_size(image_bin));
+    }
+    if (!ret) {
+        ret = spng_get_ihdr(png_ctx, &ihdr);
+    }
+    if (!ret) {
+        ret = spng_decoded_image_size(png_ctx, SPNG_FMT_RGBA8, &rgba_size);
+    }
+    if (ret) {
+        spng_ctx_free(png_ctx);
+        send_load_image_error(ref, pid, load_image_error_reason(ret), glb);
+        return;
+    }
 
-    void *out = malloc(out_size);
-    spng_decode_image(png_ctx, out, out_size, SPNG_FMT_RGBA8, 0);
+    struct LoadImageGeometry geometry;
+    term opts = (arity == 3) ? term_get_tuple_element(req, 2) : term_nil();
+    if (!load_image_geometry_init(&geometry, opts, ihdr.width, ihdr.height, glb)) {
+        spng_ctx_free(png_ctx);
+        send_load_image_error(ref, pid, ATOM_STR("\x6", "badarg"), glb);
+        return;
+    }
 
-    spng_ctx_free(png_ctx);
+    bool interlaced = ihdr.interlace_method != 0;
+    size_t rgba_row_size = rgba_size / ihdr.height;
+    size_t working_size;
+    if (!load_image_working_size(&geometry, ihdr.width, ihdr.height, rgba_row_size, format, interlaced,
+            &working_size)
+        || working_size > budget) {
+        spng_ctx_free(png_ctx);
+        send_load_image_error(ref, pid, ATOM_STR("\x9", "too_large"), glb);
+        return;
+    }
+    size_t out_size = (size_t) geometry.out_width * geometry.out_height * load_image_pixel_size(format);
 
     // term_binary_heap_size(out_size) is usually less than 100 bytes
-    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(3) + term_binary_heap_size(out_size), heap);
+    BEGIN_WITH_STACK_HEAP(TUPLE_SIZE(2) * 2 + TUPLE_SIZE(4) + term_binary_heap_size(out_size), heap);
 
-    term return_tuple = term_alloc_tuple(2, &heap);
-    term_put_tuple_element(return_tuple, 0, ref);
-    term_put_tuple_element(return_tuple, 1, term_from_literal_binary(out, out_size, &heap, ctx->global));
+    term pixels = term_create_uninitialized_binary(out_size, &heap, glb);
+    if (UNLIKELY(term_is_invalid_term(pixels))) {
+        ret = SPNG_EMEM;
+    } else {
+        ret = decode_png_rows(png_ctx, (uint8_t *) term_binary_data(pixels), ihdr.width, ihdr.height,
+            rgba_row_size, &geometry, format, interlaced);
+    }
+    spng_ctx_free(png_ctx);
 
-    free(out);
+    term reply;
+    if (ret) {
+        AtomString reason = load_image_error_reason(ret);
+        reply = term_alloc_tuple(2, &heap);
+        term_put_tuple_element(reply, 0, ERROR_ATOM);
+        term_put_tuple_element(reply, 1, globalcontext_make_atom(glb, reason));
+    } else if (arity == 2) {
+        reply = pixels;
+    } else {
+        reply = term_alloc_tuple(4, &heap);
+        term_put_tuple_element(reply, 0, format_atom);
+        term_put_tuple_element(reply, 1, term_from_int(geometry.out_width));
+        term_put_tuple_element(reply, 2, term_from_int(geometry.out_height));
+        term_put_tuple_element(reply, 3, pixels);
+    }
+    send_load_image_reply(ref, pid, reply, &heap, glb);
 
-    int local_process_id = term_to_local_process_id(pid);
-    globalcontext_send_message(ctx->global, local_process_id, return_tuple);
+    END_WITH_STACK_HEAP(heap, glb)
+}
+
+static void destroy_load_image_message(Message *message, GlobalContext *glb)
+{
+    BEGIN_WITH_STACK_HEAP(1, temp_heap);
+    mailbox_message_dispose(&message->base, &temp_heap);
+    END_WITH_STACK_HEAP(temp_heap, glb);
+}
+
+#ifndef AVM_NO_SMP
+static void *image_decoder_loop(void *args)
+{
+    struct ImageDecoder *decoder = (struct ImageDecoder *) args;
+
+    while (true) {
+        pthread_mutex_lock(&decoder->mutex);
+        while (!decoder->first) {
+            pthread_cond_wait(&decoder->job_ready, &decoder->mutex);
+        }
+        struct LoadImageJob *job = decoder->first;
+        decoder->first = job->next;
+        if (!decoder->first) {
+            decoder->last = NULL;
+        }
+        decoder->queued--;
+        pthread_mutex_unlock(&decoder->mutex);
+
+        load_image(job->req, job->ref, job->pid, job->budget, decoder->global);
+        destroy_load_image_message(job->message, decoder->global);
+        free(job);
+    }
+
+    return NULL;
+}
+#endif
+
+struct ImageDecoder *image_decoder_new(GlobalContext *glb, int max_decodes)
+{
+#ifdef AVM_NO_SMP
+    // messages can be sent from other threads only with SMP, so requests are decoded right away
+    UNUSED(glb);
+    UNUSED(max_decodes);
+    return NULL;
+#else
+    struct ImageDecoder *decoder = malloc(sizeof(struct ImageDecoder));
+    if (IS_NULL_PTR(decoder)) {
+        return NULL;
+    }
+    decoder->global = glb;
+    decoder->first = NULL;
+    decoder->last = NULL;
+    decoder->queued = 0;
+    pthread_mutex_init(&decoder->mutex, NULL);
+    pthread_cond_init(&decoder->job_ready, NULL);
+
+    // each worker decodes one image at a time, so they are the concurrent decodes limit
+    int workers = 0;
+    for (int i = 0; i < max_decodes; i++) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, image_decoder_loop, decoder) != 0) {
+            fprintf(stderr, "Failed to start image decoder thread.\n");
+            break;
+        }
+        pthread_detach(thread_id);
+        workers++;
+    }
+
+    if (workers == 0) {
+        pthread_cond_destroy(&decoder->job_ready);
+        pthread_mutex_destroy(&decoder->mutex);
+        free(decoder);
+        return NULL;
+    }
+
+    return decoder;
+#endif
+}
+
+void handle_load_image(struct ImageDecoder *decoder, size_t budget, Message *message, term req, term ref,
+    term pid, GlobalContext *glb)
+{
+    struct LoadImageJob *job = NULL;
+    if (!IS_NULL_PTR(decoder)) {
+        job = malloc(sizeof(struct LoadImageJob));
+    }
+
+    if (IS_NULL_PTR(job)) {
+        // no worker, decode right away
+        load_image(req, ref, pid, budget, glb);
+        destroy_load_image_message(message, glb);
+        return;
+    }
+
+    job->next = NULL;
+    job->message = message;
+    job->req = req;
+    job->ref = ref;
+    job->pid = pid;
+    job->budget = budget;
 
-    END_WITH_STACK_HEAP(heap, ctx->global)
+    pthread_mutex_lock(&decoder->mutex);
+    if (decoder->queued >= IMAGE_DECODER_MAX_QUEUED) {
+        pthread_mutex_unlock(&decoder->mutex);
+        free(job);
+        send_load_image_error(ref, pid, ATOM_STR("\x4", "busy"), glb);
+        destroy_load_image_message(message, glb);
+        return;
+    }
+    if (decoder->last) {
+        decoder->last->next = job;
+    } else {
+        decoder->first = job;
+    }
+    decoder->last = job;
+    decoder->queued++;
+    pthread_cond_signal(&decoder->job_ready);
+    pthread_mutex_unlock(&decoder->mutex);
 }
@@ -21,9 +21,30 @@
 #ifndef IMAGE_HELPERS_H_
 #define IMAGE_HELPERS_H_
 
-#include <context.h>
+#include <stddef.h>
+
+#include <globalcontext.h>
+#include <mailbox.h>
 #include <term.h>
 
-void handle_load_image(term req, term ref, term pid, Context *ctx);
+#define IMAGE_DECODER_DEFAULT_MAX_DECODES 2
+// requests that can wait for a worker, the others are replied with {error, busy}
+#define IMAGE_DECODER_MAX_QUEUED 16
+// bytes that a single decode can take, the returned binary included
+#define IMAGE_DECODER_DEFAULT_BUDGET (32 * 1024 * 1024)
+
+struct ImageDecoder;
+
+// Starts max_decodes worker threads, that decode load_image requests in the order they are
+// queued. Returns NULL when no worker can be started, and when AtomVM is built without SMP support,
+// since workers send replies from their own thread.
+struct ImageDecoder *image_decoder_new(GlobalContext *glb, int max_decodes);
+
+// Queues a {load_image, ...} request, the reply is sent by a worker once it has been decoded.
+// Images that need more than budget bytes are refused, and so are requests that find the queue
+// full. message holds req, ref and pid, and it is disposed once the reply has been sent, so the
+// caller must not dispose it. When decoder is NULL the request is decoded right away.
+void handle_load_image(struct ImageDecoder *decoder, size_t budget, Message *message, term req, term ref,
+    term pid, GlobalContext *glb);
 
 #endif
@@ -50,8 +50,14 @@
 
 #include <math.h>
 
+#include "arena.h"
+#include "display_atoms.h"
 #include "display_common.h"
 #include "spi_display.h"
+#include "ufontlib.h"
+
+// fonts registered with register_font, text items look them up while they are parsed
+#define ENABLE_UFONT
 
 #define CHAR_WIDTH 8
 
@@ -66,11 +72,17 @@ struct SPI
 {
     struct SPIDisplay spi_disp;
     Context *ctx;
+    struct DisplayAtoms atoms;
+    struct Arena arena;
+    // fonts registered with register_font, and their decompressed glyphs
+    UFontManager *fonts;
+    UFontGlyphCache *glyph_cache;
 };
 
 #include "display_items.h"
-#include "draw_common.h"
+#include "display_list.h"
 #include "monochrome.h"
+#include "draw_common.h"
 
 // This struct is just for compatibility reasons with the SDL display driver
 // so it is possible to easily copy & paste code from there.
@@ -109,22 +121,34 @@ static inline int get_vcom()
     return current_vcom;
 }
 
-static void do_update(Context *ctx, term display_list)
+static void do_update(Context *ctx, term req)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
+    struct SPI *spi = ctx->platform_data;
 
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
+    // items, their text and the scanline index live until the end of the frame
+    int len;
+    BaseDisplayItem *items = display_list_parse(req, ctx, &spi->atoms, spi->fonts, &spi->arena, &len);
+    if (IS_NULL_PTR(items)) {
+        fprintf(stderr, "Failed to parse display list.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
+
+    if (UNLIKELY(!ufont_text_layout_resolve(items, len, spi->glyph_cache, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate text layouts.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
 
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    struct ScanlineIndex index;
+    if (UNLIKELY(!scanline_index_init(&index, items, len, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate scanline index.\n");
+        arena_reset(&spi->arena);
+        return;
     }
 
     int screen_width = screen->w;
     int screen_height = screen->h;
-    struct SPI *spi = ctx->platform_data;
 
     int memsize = 2 + 400 / 8 + 2;
     uint8_t *buf = screen->pixels;
@@ -140,11 +164,8 @@ static void do_update(Context *ctx, term display_list)
 
         memset(buf + 2, 0xFF, DISPLAY_WIDTH / 8);
 
-        int xpos = 0;
-        while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf + 2, xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
+        scanline_index_seek(&index, ypos);
+        draw_row(buf + 2, ypos, &index, 0, screen_width);
 
         buf[0] = 0x1 | get_vcom();
         buf[1] = ypos + 1;
@@ -175,12 +196,13 @@ static void do_update(Context *ctx, term display_list)
     }
 
     spi_device_release_bus(spi->spi_disp.handle);
-    destroy_items(items, len);
+    arena_reset(&spi->arena);
 }
 
 static void send_message(term pid, term message, GlobalContext *global);
 
-static void process_message(Message *message, Context *ctx)
+// Returns true when the message is retained by a registered font, so it must not be disposed.
+static bool process_message(Message *message, Context *ctx)
 {
     GenMessage gen_message;
     if (UNLIKELY(port_parse_gen_message(message->message, &gen_message) != GenCallMessage)) {
@@ -194,10 +216,18 @@ static void process_message(Message *message, Context *ctx)
     }
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x6"
-                                      "update")) {
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+    struct SPI *spi = ctx->platform_data;
+
+    bool retained = false;
+
+    if (cmd == spi->atoms.update || cmd == spi->atoms.update_bin) {
+        do_update(ctx, req);
+
+    } else if (cmd == spi->atoms.register_font) {
+        retained = display_items_register_font(spi->fonts, req);
+        if (!retained) {
+            fprintf(stderr, "display: failed to register font.\n");
+        }
 
     } else {
 #if REPORT_UNEXPECTED_MSGS
@@ -214,6 +244,8 @@ static void process_message(Message *message, Context *ctx)
 
     send_message(gen_message.pid, return_tuple, ctx->global);
     END_WITH_STACK_HEAP(heap, ctx->global);
+
+    return retained;
 }
 
 static void process_messages(void *arg)
@@ -223,7 +255,9 @@ static void process_messages(void *arg)
     while (true) {
         Message *message;
         xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
-        process_message(message, args->ctx);
+        if (process_message(message, args->ctx)) {
+            continue;
+        }
 
         BEGIN_WITH_STACK_HEAP(1, temp_heap);
         mailbox_message_dispose(&message->base, &temp_heap);
@@ -283,6 +317,15 @@ static void display_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    display_atoms_init(&spi->atoms, ctx->global);
+    arena_init(&spi->arena);
+    spi->fonts = ufont_manager_new();
+    term glyph_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "glyph_cache_size"),
+        term_from_int(UFONT_GLYPH_CACHE_DEFAULT_BUDGET), ctx->global);
+    // without a cache glyphs are inflated each frame
+    spi->glyph_cache = ufont_glyph_cache_new((term_is_integer(glyph_cache_size) && term_to_int(glyph_cache_size) >= 0)
+            ? term_to_int(glyph_cache_size)
+            : UFONT_GLYPH_CACHE_DEFAULT_BUDGET);
 
     struct SPIDisplayConfig spi_config;
     spi_display_init_config(&spi_config);
@@ -57,7 +57,8 @@ static NativeHandlerResult display_driver_consume_mailbox(Context *ctx);
 
 static void send_message(term pid, term message, GlobalContext *global);
 
-static void process_message(Message *message, Context *ctx)
+// Returns true when the message is retained by a registered font, so it must not be disposed.
+static bool process_message(Message *message, Context *ctx)
 {
     GenMessage gen_message;
     if (UNLIKELY(port_parse_gen_message(message->message, &gen_message) != GenCallMessage)) {
@@ -71,10 +72,18 @@ static void process_message(Message *message, Context *ctx)
     }
     term cmd = term_get_tuple_element(req, 0);
 
-    if (cmd == context_make_atom(ctx, "\x6"
-                                      "update")) {
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
+    struct SPI *spi = ctx->platform_data;
+
+    bool retained = false;
+
+    if (cmd == spi->atoms.update || cmd == spi->atoms.update_bin) {
+        do_update(ctx, req);
+
+    } else if (cmd == spi->atoms.register_font) {
+        retained = display_items_register_font(spi->fonts, req);
+        if (!retained) {
+            fprintf(stderr, "display: failed to register font.\n");
+        }
 
     } else {
 #if REPORT_UNEXPECTED_MSGS
@@ -91,6 +100,8 @@ static void process_message(Message *message, Context *ctx)
 
     send_message(gen_message.pid, return_tuple, ctx->global);
     END_WITH_STACK_HEAP(heap, ctx->global);
+
+    return retained;
 }
 
 static void process_messages(void *arg)
@@ -100,7 +111,9 @@ static void process_messages(void *arg)
     while (true) {
         Message *message;
         xQueueReceive(display_messages_queue, &message, portMAX_DELAY);
-        process_message(message, args->ctx);
+        if (process_message(message, args->ctx)) {
+            continue;
+        }
 
         BEGIN_WITH_STACK_HEAP(1, temp_heap);
         mailbox_message_dispose(&message->base, &temp_heap);
@@ -70,219 +70,34 @@ static inline void draw_pixel_x(uint8_t *line_buf, int xpos, int color)
     line_buf[xpos / 8] = (line_buf[xpos / 8] & ~(0x1 << bpos)) | (color << bpos);
 }
 
-static int draw_image_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
-{
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
+// Pixel traits for draw_common.h: colors are kept as RGBA8888 since dithering depends on the
+// pixel position.
+typedef uint32_t pixel_color_t;
 
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
-
-    return drawn_pixels;
-}
-
-static int draw_scaled_cropped_img_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline pixel_color_t pixel_color_from_rgba8888(uint32_t color)
 {
-    int x = item->x;
-    int y = item->y;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            uint8_t r = img_pixel >> 24;
-            uint8_t g = (img_pixel >> 16) & 0xFF;
-            uint8_t b = (img_pixel >> 8) & 0xFF;
-
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        //TODO: optimize here
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
-    }
-
-    return drawn_pixels;
+    return color;
 }
 
-static int draw_rect_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline bool pixel_color_from_image(uint32_t img_pixel, bool visible_bg, pixel_color_t bgcolor, pixel_color_t *out)
 {
-    int x = item->x;
-    int width = item->width;
-
-    uint8_t r = (item->brcolor >> 24) & 0xFF;
-    uint8_t g = (item->brcolor >> 16) & 0xFF;
-    uint8_t b = (item->brcolor >> 8) & 0xFF;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint8_t c = get_color(xpos + drawn_pixels, ypos, r, g, b);
-        draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        drawn_pixels++;
+    // any non zero alpha is drawn as opaque
+    if (img_pixel & 0xFF) {
+        *out = img_pixel;
+        return true;
+    } else if (visible_bg) {
+        *out = bgcolor;
+        return true;
     }
 
-    return drawn_pixels;
+    return false;
 }
 
-static int draw_text_x(uint8_t *line_buf, int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline void pixel_write(uint8_t *line_buf, int xpos, int ypos, pixel_color_t color)
 {
-    int x = item->x;
-    int y = item->y;
-    bool visible_bg;
-
-    int fgcolor_r = (item->data.text_data.fgcolor >> 24) & 0xFF;
-    int fgcolor_g = (item->data.text_data.fgcolor >> 16) & 0xFF;
-    int fgcolor_b = (item->data.text_data.fgcolor >> 8) & 0xFF;
-
-    int bgcolor_r;
-    int bgcolor_g;
-    int bgcolor_b;
-
-    if (item->brcolor != 0) {
-        bgcolor_r = (item->brcolor >> 24) & 0xFF;
-        bgcolor_g = (item->brcolor >> 16) & 0xFF;
-        bgcolor_b = (item->brcolor >> 8) & 0xFF;
-        visible_bg = true;
-    } else {
-        bgcolor_r = 0;
-        bgcolor_g = 0;
-        bgcolor_b = 0;
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, fgcolor_r, fgcolor_g, fgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else if (visible_bg) {
-            uint8_t c = get_color(xpos + drawn_pixels, ypos, bgcolor_r, bgcolor_g, bgcolor_b);
-            draw_pixel_x(line_buf, xpos + drawn_pixels, c);
-
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
+    uint8_t r = (color >> 24) & 0xFF;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
 
-    return drawn_pixels;
+    draw_pixel_x(line_buf, xpos, get_color(xpos, ypos, r, g, b));
 }
@@ -0,0 +1,131 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2020-2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _RGB565_H_
+#define _RGB565_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <driver/spi_master.h>
+
+#include <utils.h>
+
+// This functions is taken from:
+// https://stackoverflow.com/questions/18937701/combining-two-16-bits-rgb-colors-with-alpha-blending
+static inline uint16_t alpha_blend_rgb565(uint32_t fg, uint32_t bg, uint8_t alpha)
+{
+    alpha = (alpha + 4) >> 3;
+    bg = (bg | (bg << 16)) & 0b00000111111000001111100000011111;
+    fg = (fg | (fg << 16)) & 0b00000111111000001111100000011111;
+    uint32_t result = ((((fg - bg) * alpha) >> 5) + bg) & 0b00000111111000001111100000011111;
+    return (uint16_t)((result >> 16) | result);
+}
+
+static inline uint8_t rgba8888_get_alpha(uint32_t color)
+{
+    return color & 0xFF;
+}
+
+static inline uint16_t rgba8888_color_to_rgb565(uint32_t color)
+{
+    uint8_t r = color >> 24;
+    uint8_t g = (color >> 16) & 0xFF;
+    uint8_t b = (color >> 8) & 0xFF;
+
+    return (((uint16_t)(r >> 3)) << 11) | (((uint16_t)(g >> 2)) << 5) | ((uint16_t) b >> 3);
+}
+
+// Panels expect big endian pixels, swapping is its own inverse.
+static inline uint16_t rgb565_color_to_surface(uint16_t color16)
+{
+    return (uint16_t) SPI_SWAP_DATA_TX(color16, 16);
+}
+
+static inline uint16_t uint32_color_to_surface(uint32_t color)
+{
+    uint16_t color16 = rgba8888_color_to_rgb565(color);
+
+    return rgb565_color_to_surface(color16);
+}
+
+// Pixel traits for draw_common.h: line buffer is made of byte swapped RGB565 pixels.
+typedef uint16_t pixel_color_t;
+
+static inline pixel_color_t pixel_color_from_rgba8888(uint32_t color)
+{
+    return uint32_color_to_surface(color);
+}
+
+static inline bool pixel_color_from_image(uint32_t img_pixel, bool visible_bg, pixel_color_t bgcolor, pixel_color_t *out)
+{
+    uint8_t alpha = rgba8888_get_alpha(img_pixel);
+    if (alpha == 0xFF) {
+        *out = uint32_color_to_surface(img_pixel);
+        return true;
+    } else if (visible_bg) {
+        uint16_t color = rgba8888_color_to_rgb565(img_pixel);
+        uint16_t blended = alpha_blend_rgb565(color, rgb565_color_to_surface(bgcolor), alpha);
+        *out = rgb565_color_to_surface(blended);
+        return true;
+    }
+
+    return false;
+}
+
+// rgb565_be images are already in the line buffer format.
+#define PIXEL_NATIVE_RGB565_BE
+
+static inline pixel_color_t pixel_color_from_rgb565(uint16_t color)
+{
+    return rgb565_color_to_surface(color);
+}
+
+// Used by image_cache.h, native images keep the alpha channel apart.
+static inline uint8_t pixel_alpha_from_image(uint32_t img_pixel)
+{
+    return rgba8888_get_alpha(img_pixel);
+}
+
+static inline pixel_color_t pixel_color_blend(pixel_color_t fg, pixel_color_t bg, uint8_t alpha)
+{
+    uint16_t blended = alpha_blend_rgb565(rgb565_color_to_surface(fg), rgb565_color_to_surface(bg), alpha);
+
+    return rgb565_color_to_surface(blended);
+}
+
+static inline void pixel_write(uint8_t *line_buf, int xpos, int ypos, pixel_color_t color)
+{
+    UNUSED(ypos);
+
+    ((uint16_t *) line_buf)[xpos] = color;
+}
+
+// Partially transparent pixels are blended with what is already in the line buffer.
+#define PIXEL_COMPOSITE
+
+static inline pixel_color_t pixel_read(const uint8_t *line_buf, int xpos, int ypos)
+{
+    UNUSED(ypos);
+
+    return ((const uint16_t *) line_buf)[xpos];
+}
+
+#endif
@@ -0,0 +1,294 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SCANLINE_INDEX_H_
+#define _SCANLINE_INDEX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "arena.h"
+
+// display_items.h must be included before this file.
+
+// A run of pixels of the current row where the set of items covering it does not change.
+// top is the position in the active list of the topmost item covering the run, bottom is the
+// position of the first opaque item at or below top (or of the last covering item when none of
+// them is opaque). Items in [top, bottom] that do not cover the run must be skipped: use
+// scanline_span_is_covered_by.
+struct ScanlineSpan
+{
+    int x0;
+    int x1;
+    int top;
+    int bottom;
+};
+
+struct ScanlineEdge
+{
+    int x;
+    int active_pos;
+    bool start;
+};
+
+// Per-frame spatial index: items are sorted once by their top edge, and then an active list is
+// kept while sweeping rows top to bottom, so each scanline only deals with the items that
+// actually intersect it.
+// The active list is always kept in display list order (first item is the topmost one), so
+// draw_x and friends can walk it exactly as they used to walk the whole display list.
+struct ScanlineIndex
+{
+    BaseDisplayItem *items;
+
+    // indexes of items sorted by y (ties keep display list order)
+    int *by_top;
+    int by_top_count;
+    int next_top;
+
+    // items intersecting the current row, in display list order
+    BaseDisplayItem **active;
+    int active_count;
+
+    // scratch buffers for scanline_index_spans
+    struct ScanlineEdge *edges;
+    uint8_t *covered;
+    struct ScanlineSpan *spans;
+};
+
+static BaseDisplayItem *scanline_index_sort_items;
+
+static int scanline_index_cmp_top(const void *a, const void *b)
+{
+    int index_a = *((const int *) a);
+    int index_b = *((const int *) b);
+    int y_a = scanline_index_sort_items[index_a].y;
+    int y_b = scanline_index_sort_items[index_b].y;
+
+    if (y_a != y_b) {
+        return (y_a < y_b) ? -1 : 1;
+    }
+
+    return index_a - index_b;
+}
+
+// Buffers are allocated from the frame arena, so they are released when the arena is reset.
+static bool scanline_index_init(struct ScanlineIndex *index, BaseDisplayItem *items, int items_count,
+    struct Arena *arena)
+{
+    index->items = items;
+    index->by_top_count = 0;
+    index->next_top = 0;
+    index->active_count = 0;
+
+    index->by_top = arena_alloc(arena, sizeof(int) * items_count);
+    index->active = arena_alloc(arena, sizeof(BaseDisplayItem *) * items_count);
+    index->edges = arena_alloc(arena, sizeof(struct ScanlineEdge) * 2 * items_count);
+    index->covered = arena_alloc(arena, sizeof(uint8_t) * items_count);
+    // each edge starts at most one new span
+    index->spans = arena_alloc(arena, sizeof(struct ScanlineSpan) * 2 * items_count);
+    if (IS_NULL_PTR(index->by_top) || IS_NULL_PTR(index->active) || IS_NULL_PTR(index->edges)
+        || IS_NULL_PTR(index->covered) || IS_NULL_PTR(index->spans)) {
+        return false;
+    }
+
+    int sorted_count = 0;
+    for (int i = 0; i < items_count; i++) {
+        // zero height items never intersect a row, while zero width ones still
+        // split spans in find_max_line_len, so they are kept
+        if (items[i].height > 0) {
+            index->by_top[sorted_count] = i;
+            sorted_count++;
+        }
+    }
+    index->by_top_count = sorted_count;
+
+    // qsort comparator has no context argument
+    scanline_index_sort_items = items;
+    qsort(index->by_top, sorted_count, sizeof(int), scanline_index_cmp_top);
+
+    return true;
+}
+
+// Restarts the sweep from the top, so another pass can be done with scanline_index_seek.
+static void scanline_index_rewind(struct ScanlineIndex *index)
+{
+    index->next_top = 0;
+    index->active_count = 0;
+}
+
+// ypos must be increasing across calls, rows can be skipped.
+static void scanline_index_seek(struct ScanlineIndex *index, int ypos)
+{
+    // drop items that ended above this row, keeping the order
+    int kept = 0;
+    for (int i = 0; i < index->active_count; i++) {
+        BaseDisplayItem *item = index->active[i];
+        if (ypos < item->y + item->height) {
+            index->active[kept] = item;
+            kept++;
+        }
+    }
+    index->active_count = kept;
+
+    // add items starting at or above this row, active list is sorted by display list position
+    while (index->next_top < index->by_top_count) {
+        BaseDisplayItem *item = &index->items[index->by_top[index->next_top]];
+        if (item->y > ypos) {
+            break;
+        }
+        index->next_top++;
+
+        if (ypos >= item->y + item->height) {
+            // it has been skipped entirely
+            continue;
+        }
+
+        int pos = index->active_count;
+        while (pos > 0 && index->active[pos - 1] > item) {
+            index->active[pos] = index->active[pos - 1];
+            pos--;
+        }
+        index->active[pos] = item;
+        index->active_count++;
+    }
+}
+
+// Opaque items draw every pixel of their bounding box, so nothing below them is visible.
+static bool scanline_item_is_opaque(const BaseDisplayItem *item)
+{
+    switch (item->primitive) {
+        case Rect:
+            return true;
+
+        case Image:
+            return (item->brcolor != 0) || image_format_is_opaque(item->image_format.format);
+
+        case Text:
+            return item->brcolor != 0;
+
+        case ScaledCroppedImage: {
+            // area on the right of and below the source image is left undrawn
+            const struct ImageDataWithSize *img = &item->data.image_data_with_size;
+            return ((item->brcolor != 0) || image_format_is_opaque(item->image_format.format))
+                && (item->width <= scaled_extent(img->width, item->source_x, item->x_scale))
+                && (item->height <= scaled_extent(img->height, item->source_y, item->y_scale));
+        }
+
+        default:
+            return false;
+    }
+}
+
+static inline bool scanline_span_is_covered_by(const struct ScanlineSpan *span, const BaseDisplayItem *item)
+{
+    return (item->x <= span->x0) && (item->x + item->width >= span->x1);
+}
+
+static int scanline_index_cmp_edge(const void *a, const void *b)
+{
+    const struct ScanlineEdge *edge_a = a;
+    const struct ScanlineEdge *edge_b = b;
+
+    if (edge_a->x != edge_b->x) {
+        return (edge_a->x < edge_b->x) ? -1 : 1;
+    }
+
+    return edge_a->active_pos - edge_b->active_pos;
+}
+
+// Splits [x0, x1) of the row selected with scanline_index_seek into spans, sweeping over left and
+// right edges of active items. Spans are sorted by x and stored in index->spans, runs that are not
+// covered by any item are not returned.
+static int scanline_index_spans(struct ScanlineIndex *index, int x0, int x1)
+{
+    int edges_count = 0;
+    for (int i = 0; i < index->active_count; i++) {
+        BaseDisplayItem *item = index->active[i];
+        int left = (item->x > x0) ? item->x : x0;
+        int right = (item->x + item->width < x1) ? item->x + item->width : x1;
+        index->covered[i] = 0;
+        if (left >= right) {
+            continue;
+        }
+
+        index->edges[edges_count].x = left;
+        index->edges[edges_count].active_pos = i;
+        index->edges[edges_count].start = true;
+        index->edges[edges_count + 1].x = right;
+        index->edges[edges_count + 1].active_pos = i;
+        index->edges[edges_count + 1].start = false;
+        edges_count += 2;
+    }
+
+    qsort(index->edges, edges_count, sizeof(struct ScanlineEdge), scanline_index_cmp_edge);
+
+    int spans_count = 0;
+    int covering_count = 0;
+    int e = 0;
+    while (e < edges_count) {
+        int span_x0 = index->edges[e].x;
+        while (e < edges_count && index->edges[e].x == span_x0) {
+            struct ScanlineEdge *edge = &index->edges[e];
+            index->covered[edge->active_pos] = edge->start;
+            covering_count += edge->start ? 1 : -1;
+            e++;
+        }
+
+        if (covering_count == 0 || e == edges_count) {
+            continue;
+        }
+
+        int top = 0;
+        while (!index->covered[top]) {
+            top++;
+        }
+        int bottom = top;
+        for (int i = top; i < index->active_count; i++) {
+            if (index->covered[i]) {
+                bottom = i;
+                if (scanline_item_is_opaque(index->active[i])) {
+                    break;
+                }
+            }
+        }
+
+        int span_x1 = index->edges[e].x;
+
+        // opaque runs of the same item can be merged, since nothing else is drawn there
+        struct ScanlineSpan *last = (spans_count > 0) ? &index->spans[spans_count - 1] : NULL;
+        if (last && (last->x1 == span_x0) && (last->top == top) && (last->bottom == top)
+            && (bottom == top)) {
+            last->x1 = span_x1;
+            continue;
+        }
+
+        struct ScanlineSpan *span = &index->spans[spans_count];
+        span->x0 = span_x0;
+        span->x1 = span_x1;
+        span->top = top;
+        span->bottom = bottom;
+        spans_count++;
+    }
+
+    return spans_count;
+}
+
+#endif
@@ -0,0 +1,496 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _SCENE_H_
+#define _SCENE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <context.h>
+#include <globalcontext.h>
+#include <mailbox.h>
+#include <memory.h>
+#include <term.h>
+
+// display_items.h, display_list.h and damage.h must be included before this file.
+
+#define SCENE_ID_INDEX_MIN_SLOTS 16
+
+// Items point to binaries that live in the message they come from, so a message is disposed only
+// when no item is referencing it anymore.
+struct SceneOwner
+{
+    Message *message;
+    int refcount;
+};
+
+// Retained display list, that survives across messages. Items can be changed one by one using
+// their id (an atom or a small integer), items sent with update have no id.
+// Items outlive the frame they are drawn in, so they are allocated on the heap rather than from
+// the frame arena.
+struct Scene
+{
+    // display list order: first item is the topmost one
+    BaseDisplayItem *items;
+    term *ids;
+    struct SceneOwner **owners;
+    int count;
+    int capacity;
+
+    // open addressing table from ids to items: slots hold the item index + 1, and 0 when they are
+    // empty. Moving items makes it stale, and it is rebuilt by the next scene_find.
+    int *id_slots;
+    int id_slots_count;
+    bool id_index_stale;
+
+    GlobalContext *global;
+    const struct DisplayAtoms *atoms;
+    // fonts registered to the display
+    struct UFontManager *fonts;
+};
+
+static void destroy_message(Message *message, GlobalContext *global)
+{
+    BEGIN_WITH_STACK_HEAP(1, temp_heap);
+    mailbox_message_dispose(&message->base, &temp_heap);
+    END_WITH_STACK_HEAP(temp_heap, global);
+}
+
+static void scene_owner_unref(struct SceneOwner *owner, GlobalContext *global)
+{
+    owner->refcount--;
+    if (owner->refcount == 0) {
+        destroy_message(owner->message, global);
+        free(owner);
+    }
+}
+
+static void scene_init(struct Scene *scene, GlobalContext *global, const struct DisplayAtoms *atoms,
+    struct UFontManager *fonts)
+{
+    scene->items = NULL;
+    scene->ids = NULL;
+    scene->owners = NULL;
+    scene->count = 0;
+    scene->capacity = 0;
+    scene->id_slots = NULL;
+    scene->id_slots_count = 0;
+    scene->id_index_stale = true;
+    scene->global = global;
+    scene->atoms = atoms;
+    scene->fonts = fonts;
+}
+
+static bool scene_ensure_capacity(struct Scene *scene, int count)
+{
+    if (count <= scene->capacity) {
+        return true;
+    }
+
+    int capacity = (scene->capacity * 2 > count) ? scene->capacity * 2 : count;
+
+    BaseDisplayItem *items = realloc(scene->items, sizeof(BaseDisplayItem) * capacity);
+    if (IS_NULL_PTR(items)) {
+        return false;
+    }
+    scene->items = items;
+
+    term *ids = realloc(scene->ids, sizeof(term) * capacity);
+    if (IS_NULL_PTR(ids)) {
+        return false;
+    }
+    scene->ids = ids;
+
+    struct SceneOwner **owners = realloc(scene->owners, sizeof(struct SceneOwner *) * capacity);
+    if (IS_NULL_PTR(owners)) {
+        return false;
+    }
+    scene->owners = owners;
+
+    scene->capacity = capacity;
+
+    return true;
+}
+
+static void scene_release_item(struct Scene *scene, int index)
+{
+    destroy_item(&scene->items[index]);
+    scene_owner_unref(scene->owners[index], scene->global);
+}
+
+static inline unsigned int scene_id_hash(term id)
+{
+    // low bits of terms are mostly tag bits
+    uint32_t hash = (uint32_t) id * 2654435761U;
+    return hash ^ (hash >> 16);
+}
+
+static void scene_id_index_add(struct Scene *scene, int index)
+{
+    unsigned int mask = scene->id_slots_count - 1;
+    unsigned int slot = scene_id_hash(scene->ids[index]) & mask;
+    while (scene->id_slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    scene->id_slots[slot] = index + 1;
+}
+
+// Slots are kept at most half full, items without an id are not indexed.
+static bool scene_id_index_rebuild(struct Scene *scene)
+{
+    int slots_count = SCENE_ID_INDEX_MIN_SLOTS;
+    while (slots_count < scene->count * 2) {
+        slots_count *= 2;
+    }
+
+    if (slots_count != scene->id_slots_count) {
+        int *slots = realloc(scene->id_slots, sizeof(int) * slots_count);
+        if (IS_NULL_PTR(slots)) {
+            return false;
+        }
+        scene->id_slots = slots;
+        scene->id_slots_count = slots_count;
+    }
+    memset(scene->id_slots, 0, sizeof(int) * slots_count);
+
+    for (int i = 0; i < scene->count; i++) {
+        if (!term_is_invalid_term(scene->ids[i])) {
+            scene_id_index_add(scene, i);
+        }
+    }
+    scene->id_index_stale = false;
+
+    return true;
+}
+
+static int scene_find(struct Scene *scene, term id)
+{
+    if (scene->id_index_stale && !scene_id_index_rebuild(scene)) {
+        // no memory for the index
+        for (int i = 0; i < scene->count; i++) {
+            if (scene->ids[i] == id) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    unsigned int mask = scene->id_slots_count - 1;
+    for (unsigned int slot = scene_id_hash(id) & mask; scene->id_slots[slot] != 0; slot = (slot + 1) & mask) {
+        int index = scene->id_slots[slot] - 1;
+        if (scene->ids[index] == id) {
+            return index;
+        }
+    }
+
+    return -1;
+}
+
+static bool scene_insert(struct Scene *scene, int index, term id, const BaseDisplayItem *item,
+    struct SceneOwner *owner, struct DamageRegion *damage)
+{
+    if (UNLIKELY(!scene_ensure_capacity(scene, scene->count + 1))) {
+        return false;
+    }
+
+    int moved = scene->count - index;
+    memmove(&scene->items[index + 1], &scene->items[index], sizeof(BaseDisplayItem) * moved);
+    memmove(&scene->ids[index + 1], &scene->ids[index], sizeof(term) * moved);
+    memmove(&scene->owners[index + 1], &scene->owners[index], sizeof(struct SceneOwner *) * moved);
+
+    scene->items[index] = *item;
+    scene->ids[index] = id;
+    scene->owners[index] = owner;
+    owner->refcount++;
+    scene->count++;
+
+    // appended items do not move the others, so they are added to the index while it has room
+    if (index != scene->count - 1 || scene->count * 2 > scene->id_slots_count) {
+        scene->id_index_stale = true;
+    } else if (!scene->id_index_stale && !term_is_invalid_term(id)) {
+        scene_id_index_add(scene, index);
+    }
+
+    damage_region_add_item(damage, item);
+
+    return true;
+}
+
+static void scene_replace(struct Scene *scene, int index, const BaseDisplayItem *item,
+    struct SceneOwner *owner, struct DamageRegion *damage)
+{
+    BaseDisplayItem *old_item = &scene->items[index];
+    if (!cmp_display_item(old_item, (BaseDisplayItem *) item)) {
+        damage_region_add_item(damage, old_item);
+        damage_region_add_item(damage, item);
+    }
+
+    // owner is referenced by the message being processed, so it cannot go away here
+    scene_release_item(scene, index);
+    scene->items[index] = *item;
+    scene->owners[index] = owner;
+    owner->refcount++;
+}
+
+static void scene_remove(struct Scene *scene, int index, struct DamageRegion *damage)
+{
+    damage_region_add_item(damage, &scene->items[index]);
+    scene_release_item(scene, index);
+
+    int moved = scene->count - index - 1;
+    memmove(&scene->items[index], &scene->items[index + 1], sizeof(BaseDisplayItem) * moved);
+    memmove(&scene->ids[index], &scene->ids[index + 1], sizeof(term) * moved);
+    memmove(&scene->owners[index], &scene->owners[index + 1], sizeof(struct SceneOwner *) * moved);
+    scene->count--;
+    scene->id_index_stale = true;
+}
+
+static inline bool scene_is_valid_id(term id)
+{
+    return term_is_atom(id) || term_is_integer(id);
+}
+
+// {update, DisplayList} and {update_bin, Binary, Images}: the whole scene is replaced, and only
+// what changed is damaged.
+static void scene_update(struct Scene *scene, Context *ctx, struct SceneOwner *owner, term req,
+    struct DamageRegion *damage)
+{
+    int len;
+    BaseDisplayItem *items = display_list_parse(req, ctx, scene->atoms, scene->fonts, NULL, &len);
+    if (IS_NULL_PTR(items)) {
+        fprintf(stderr, "invalid display list: ");
+        term_display(stderr, req, ctx);
+        fprintf(stderr, "\n");
+        return;
+    }
+
+    term *ids = malloc(sizeof(term) * ((len > 0) ? len : 1));
+    struct SceneOwner **owners = malloc(sizeof(struct SceneOwner *) * ((len > 0) ? len : 1));
+    if (IS_NULL_PTR(ids) || IS_NULL_PTR(owners)) {
+        fprintf(stderr, "Failed to allocate display list.\n");
+        for (int i = 0; i < len; i++) {
+            destroy_item(&items[i]);
+        }
+        free(items);
+        free(ids);
+        free(owners);
+        return;
+    }
+
+    for (int i = 0; i < len; i++) {
+        ids[i] = term_invalid_term();
+        owners[i] = owner;
+    }
+    owner->refcount += len;
+
+    if (scene->count > 0) {
+        damage_region_diff(damage, scene->items, scene->count, items, len);
+    } else {
+        damage_region_mark_all(damage);
+    }
+
+    for (int i = 0; i < scene->count; i++) {
+        scene_release_item(scene, i);
+    }
+    free(scene->items);
+    free(scene->ids);
+    free(scene->owners);
+
+    scene->items = items;
+    scene->ids = ids;
+    scene->owners = owners;
+    scene->count = len;
+    scene->capacity = (len > 0) ? len : 1;
+    scene->id_index_stale = true;
+}
+
+// {update_items, [{Id, Item}]}: items are replaced in place, unknown ids are appended at the
+// bottom of the display list.
+static void scene_update_items(struct Scene *scene, Context *ctx, struct SceneOwner *owner,
+    term updates, struct DamageRegion *damage)
+{
+    for (term t = updates; term_is_nonempty_list(t); t = term_get_list_tail(t)) {
+        term update = term_get_list_head(t);
+        if (UNLIKELY(!term_is_tuple(update) || term_get_tuple_arity(update) != 2
+                || !scene_is_valid_id(term_get_tuple_element(update, 0)))) {
+            fprintf(stderr, "invalid item update: ");
+            term_display(stderr, update, ctx);
+            fprintf(stderr, "\n");
+            continue;
+        }
+
+        term id = term_get_tuple_element(update, 0);
+        BaseDisplayItem item;
+        memset(&item, 0, sizeof(BaseDisplayItem));
+        init_item(&item, term_get_tuple_element(update, 1), ctx, scene->atoms, scene->fonts, NULL);
+
+        int index = scene_find(scene, id);
+        if (index >= 0) {
+            scene_replace(scene, index, &item, owner, damage);
+        } else if (UNLIKELY(!scene_insert(scene, scene->count, id, &item, owner, damage))) {
+            fprintf(stderr, "Failed to allocate display item.\n");
+            destroy_item(&item);
+        }
+    }
+}
+
+// {remove_items, Ids}: unknown ids are ignored. Items are released first, and then the display list
+// is compacted once, so that removing many items does not move the others many times.
+static void scene_remove_items(struct Scene *scene, term ids, struct DamageRegion *damage)
+{
+    bool *removed = calloc((scene->count > 0) ? scene->count : 1, sizeof(bool));
+    if (IS_NULL_PTR(removed)) {
+        for (term t = ids; term_is_nonempty_list(t); t = term_get_list_tail(t)) {
+            int index = scene_find(scene, term_get_list_head(t));
+            if (index >= 0) {
+                scene_remove(scene, index, damage);
+            }
+        }
+        return;
+    }
+
+    int removed_count = 0;
+    for (term t = ids; term_is_nonempty_list(t); t = term_get_list_tail(t)) {
+        int index = scene_find(scene, term_get_list_head(t));
+        if (index >= 0 && !removed[index]) {
+            damage_region_add_item(damage, &scene->items[index]);
+            scene_release_item(scene, index);
+            removed[index] = true;
+            removed_count++;
+        }
+    }
+
+    if (removed_count > 0) {
+        int count = 0;
+        for (int i = 0; i < scene->count; i++) {
+            if (!removed[i]) {
+                scene->items[count] = scene->items[i];
+                scene->ids[count] = scene->ids[i];
+                scene->owners[count] = scene->owners[i];
+                count++;
+            }
+        }
+        scene->count = count;
+        scene->id_index_stale = true;
+    }
+
+    free(removed);
+}
+
+// {insert_before, Id, {NewId, Item}}: the new item is placed right above Id. When NewId already
+// exists it is moved.
+static void scene_insert_before(struct Scene *scene, Context *ctx, struct SceneOwner *owner,
+    term id, term new_item, struct DamageRegion *damage)
+{
+    if (UNLIKELY(!term_is_tuple(new_item) || term_get_tuple_arity(new_item) != 2
+            || !scene_is_valid_id(term_get_tuple_element(new_item, 0)))) {
+        fprintf(stderr, "invalid item: ");
+        term_display(stderr, new_item, ctx);
+        fprintf(stderr, "\n");
+        return;
+    }
+
+    int index = scene_find(scene, id);
+    if (index < 0) {
+        fprintf(stderr, "insert_before: unknown item id: ");
+        term_display(stderr, id, ctx);
+        fprintf(stderr, "\n");
+        return;
+    }
+
+    term new_id = term_get_tuple_element(new_item, 0);
+    BaseDisplayItem item;
+    memset(&item, 0, sizeof(BaseDisplayItem));
+    init_item(&item, term_get_tuple_element(new_item, 1), ctx, scene->atoms, scene->fonts, NULL);
+
+    int existing = scene_find(scene, new_id);
+    if (existing == index) {
+        scene_replace(scene, index, &item, owner, damage);
+        return;
+    } else if (existing >= 0) {
+        scene_remove(scene, existing, damage);
+        if (existing < index) {
+            index--;
+        }
+    }
+
+    if (UNLIKELY(!scene_insert(scene, index, new_id, &item, owner, damage))) {
+        fprintf(stderr, "Failed to allocate display item.\n");
+        destroy_item(&item);
+    }
+}
+
+// Handles scene commands, returns false if cmd is not one of them. retained is set to true when
+// items are referencing the message, otherwise the caller is in charge of disposing it.
+static bool scene_handle_command(struct Scene *scene, Context *ctx, Message *message, term req,
+    struct DamageRegion *damage, bool *retained)
+{
+    const struct DisplayAtoms *atoms = scene->atoms;
+    term cmd = term_get_tuple_element(req, 0);
+    int arity = term_get_tuple_arity(req);
+
+    *retained = false;
+
+    bool is_update = (cmd == atoms->update) || (cmd == atoms->update_bin);
+    bool is_update_items = (cmd == atoms->update_items);
+    bool is_remove_items = (cmd == atoms->remove_items);
+    bool is_insert_before = (cmd == atoms->insert_before);
+    if (!is_update && !is_update_items && !is_remove_items && !is_insert_before) {
+        return false;
+    }
+
+    struct SceneOwner *owner = malloc(sizeof(struct SceneOwner));
+    if (IS_NULL_PTR(owner)) {
+        fprintf(stderr, "Failed to allocate scene owner.\n");
+        return true;
+    }
+    owner->message = message;
+    // this reference is held while the message is being processed
+    owner->refcount = 1;
+
+    if (is_update) {
+        scene_update(scene, ctx, owner, req, damage);
+    } else if (is_update_items && arity == 2) {
+        scene_update_items(scene, ctx, owner, term_get_tuple_element(req, 1), damage);
+    } else if (is_remove_items && arity == 2) {
+        scene_remove_items(scene, term_get_tuple_element(req, 1), damage);
+    } else if (is_insert_before && arity == 3) {
+        scene_insert_before(scene, ctx, owner, term_get_tuple_element(req, 1),
+            term_get_tuple_element(req, 2), damage);
+    } else {
+        fprintf(stderr, "invalid scene command: ");
+        term_display(stderr, req, ctx);
+        fprintf(stderr, "\n");
+    }
+
+    owner->refcount--;
+    if (owner->refcount == 0) {
+        free(owner);
+    } else {
+        *retained = true;
+    }
+
+    return true;
+}
+
+#endif
@@ -31,7 +31,7 @@
 #include <term.h>
 #include <utils.h>
 
-#include "ufontlib.h"
+#include "../ufontlib.h"
 
 #define SCREEN_WIDTH 320
 #define SCREEN_HEIGHT 240
@@ -39,7 +39,13 @@
 #define DEPTH 32
 
 #define CHAR_WIDTH 8
+
+#define ENABLE_UFONT
+
 #include "../display_items.h"
+#include "../display_list.h"
+#include "../damage.h"
+#include "../scene.h"
 #include "../font.c"
 #include "../image_helpers.h"
 
@@ -64,15 +70,6 @@ struct MouseEvent
     int y;
 };
 
-struct Rectangle
-{
-    int x;
-    int y;
-    int width;
-    int height;
-    bool valid;
-};
-
 static term keyboard_pid;
 static struct timespec ts0;
 Context *the_ctx;
@@ -91,459 +88,138 @@ static SDL_Surface *surface;
 static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
 
-UFontManager *ufont_manager;
+static struct ImageDecoder *image_decoder;
+static size_t image_decode_budget;
 
 static NativeHandlerResult consume_display_mailbox(Context *ctx);
 static void *display_loop();
 
-Message *prev_message = NULL;
-BaseDisplayItem *prev_items = NULL;
-int prev_items_len = 0;
-
-static void destroy_message(Message *m, GlobalContext *global)
-{
-    BEGIN_WITH_STACK_HEAP(1, temp_heap);
-    mailbox_message_dispose(&m->base, &temp_heap);
-    END_WITH_STACK_HEAP(temp_heap, global);
-}
-
-static inline int int_min(int a, int b)
-{
-    return (a > b) ? b : a;
-}
-
-static inline int int_max(int a, int b)
-{
-    return (a > b) ? a : b;
-}
-
-static bool cmp_display_item(BaseDisplayItem *a, BaseDisplayItem *b)
-{
-    if (a->primitive != b->primitive || a->x != b->x || a->y != b->y ||
-            a->width != b->width || a->height != b->height || a->brcolor != b->brcolor) {
-        return false;
-    }
-
-    switch (a->primitive) {
-        case Image:
-            return a->data.image_data.pix == b->data.image_data.pix;
-
-        case Rect:
-            return true;
-
-        case Text:
-            return (a->data.text_data.fgcolor == b->data.text_data.fgcolor) &&
-                !strcmp(a->data.text_data.text, b->data.text_data.text);
-
-        case ScaledCroppedImage:
-            return (a->data.image_data.pix == b->data.image_data.pix) &&
-                (a->x_scale == b->x_scale) && (a->y_scale == b->y_scale) &&
-                (a->source_x == b->source_x) && (a->source_y == b->source_y);
-
-        default: {
-            return true;
-        }
-    }
-}
-
-static void update_damaged_area(struct Rectangle *area, const struct Rectangle *damage)
-{
-    if (area->valid) {
-        area->x = int_min(area->x, damage->x);
-        area->y = int_min(area->y, damage->y);
-        area->width = int_max(area->x + area->width, damage->x + damage->width) - area->x;
-        area->height = int_max(area->y + area->height, damage->y + damage->height) - area->y;
-    } else {
-        area->x = damage->x;
-        area->y = damage->y;
-        area->width = damage->width;
-        area->height = damage->height;
-        area->valid = true;
-    }
-}
-
-static void clip_rectangle(struct Rectangle *rectangle, const struct Rectangle *clip_region)
-{
-    rectangle->x = int_max(rectangle->x, clip_region->x);
-    rectangle->y = int_max(rectangle->y, clip_region->y);
-    rectangle->width = int_min(rectangle->x + rectangle->width, clip_region->x + clip_region->width) - rectangle->x;
-    rectangle->height = int_min(rectangle->y + rectangle->height, clip_region->y + clip_region->height) - rectangle->y;
-}
-
-static void dumb_diff(BaseDisplayItem *orig, int orig_len, BaseDisplayItem *new, int new_len, struct Rectangle *damaged)
-{
-    if (orig_len == 0) {
-        for (int i = 0; i < new_len; i++) {
-            struct Rectangle irect = {
-                .x = new[i].x,
-                .y = new[i].y,
-                .width = new[i].width,
-                .height = new[i].height,
-                .valid = true
-            };
-            update_damaged_area(damaged, &irect);
-        }
-        return;
-    }
-
-    int j = 0;
+static struct DisplayAtoms display_atoms;
+static struct Arena frame_arena;
+// fonts registered with register_font
+static UFontManager *fonts;
 
-    for (int i = 0; i < new_len; i++) {
-        if (cmp_display_item(&new[i], &orig[j])) {
-            j++;
-        } else {
-            bool found = false;
-            for (int k = j + 1; k < orig_len; k++) {
-                if (cmp_display_item(&new[i], &orig[k])) {
-                    for (int l = k - j; l < k; l++) {
-                        struct Rectangle irect = {
-                            .x = orig[l].x,
-                            .y = orig[l].y,
-                            .width = orig[l].width,
-                            .height = orig[l].height,
-                            .valid = true
-                        };
-                        update_damaged_area(damaged, &irect);
-                    }
-
-                    j = k + 1;
-                    found = true;
-                    break;
-                }
-            }
-            if (!found) {
-                struct Rectangle irect = {
-                    .x = new[i].x,
-                    .y = new[i].y,
-                    .width = new[i].width,
-                    .height = new[i].height,
-                    .valid = true
-                };
-                update_damaged_area(damaged, &irect);
-            }
-        }
-    }
-}
+// retained display list, and areas that have to be redrawn
+static struct Scene scene;
+static struct DamageRegion damage;
 
 static inline Uint32 uint32_color_to_surface(struct Screen *screen, uint32_t color)
 {
     return SDL_MapRGB(screen->format, (color >> 24) & 0xFF, (color >> 16) & 0xFF, (color >> 8) & 0xFF);
 }
 
-struct Surface
-{
-    int width;
-    int height;
-    void *buffer;
-};
+// Pixel traits for draw_common.h
+typedef Uint32 pixel_color_t;
 
-void epd_draw_pixel(int xpos, int ypos, uint8_t color, void *buffer)
+static inline pixel_color_t pixel_color_from_rgba8888(uint32_t color)
 {
-    struct Surface *surface = buffer;
-
-    if (xpos < 0 || ypos < 0 || xpos >= surface->width || ypos >= surface->height) {
-        return;
-    }
-
-    Uint32 *pixmem32b = (Uint32 *) (((uint8_t *) surface->buffer) + surface->width * ypos * BPP + xpos * BPP);
-
-    //TODO: handle other colors than black
-    UNUSED(color);
-    *pixmem32b = 0xFF000000;
+    return uint32_color_to_surface(screen, color);
 }
 
-static int draw_image_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline pixel_color_t pixel_color_blend(pixel_color_t fg, pixel_color_t bg, uint8_t alpha)
 {
-    int x = item->x;
-    int y = item->y;
-
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data.pix;
-
-    int drawn_pixels = 0;
-
-    uint32_t *pixels = ((uint32_t *) data) + (ypos - y) * width + (xpos - x);
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            Uint32 color = uint32_color_to_surface(screen, img_pixel);
-            pixmem32[drawn_pixels] = color;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels++;
-    }
-
-    return drawn_pixels;
+    Uint8 fg_r, fg_g, fg_b;
+    Uint8 bg_r, bg_g, bg_b;
+    SDL_GetRGB(fg, screen->format, &fg_r, &fg_g, &fg_b);
+    SDL_GetRGB(bg, screen->format, &bg_r, &bg_g, &bg_b);
+
+    return SDL_MapRGB(screen->format,
+        (fg_r * alpha + bg_r * (255 - alpha)) / 255,
+        (fg_g * alpha + bg_g * (255 - alpha)) / 255,
+        (fg_b * alpha + bg_b * (255 - alpha)) / 255);
 }
 
-static int draw_scaled_cropped_img_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline bool pixel_color_from_image(uint32_t img_pixel, bool visible_bg, pixel_color_t bgcolor, pixel_color_t *out)
 {
-    int x = item->x;
-    int y = item->y;
-
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    int width = item->width;
-    const char *data = item->data.image_data_with_size.pix;
-
-    int drawn_pixels = 0;
-
-    int y_scale = item->y_scale;
-    int x_scale = item->x_scale;
-    int img_width = item->data.image_data_with_size.width;
-
-    int source_x = item->source_x;
-    int source_y = item->source_y;
-
-    uint32_t *pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + ((xpos - x) / x_scale);
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (source_x + (width / x_scale) > img_width) {
-        width = (img_width - source_x) * x_scale;
-    }
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        uint32_t img_pixel = READ_32_UNALIGNED(pixels);
-        if ((*pixels >> 24) & 0xFF) {
-            Uint32 color = uint32_color_to_surface(screen, img_pixel);
-            pixmem32[drawn_pixels] = color;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-        pixels = ((uint32_t *) data) + (source_y + ((ypos - y) / y_scale)) * img_width + source_x + (j / x_scale);
+    uint8_t alpha = img_pixel & 0xFF;
+    if (alpha == 0xFF) {
+        *out = uint32_color_to_surface(screen, img_pixel);
+        return true;
+    } else if (visible_bg) {
+        *out = pixel_color_blend(uint32_color_to_surface(screen, img_pixel), bgcolor, alpha);
+        return true;
     }
 
-    return drawn_pixels;
+    return false;
 }
 
-static int draw_rect_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline uint8_t pixel_alpha_from_image(uint32_t img_pixel)
 {
-    int x = item->x;
-    int width = item->width;
-    uint32_t color = uint32_color_to_surface(screen, item->brcolor);
-
-    int drawn_pixels = 0;
-
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        pixmem32[drawn_pixels] = color;
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
+    return img_pixel & 0xFF;
 }
 
-static int draw_text_x(int xpos, int ypos, int max_line_len, BaseDisplayItem *item)
+static inline void pixel_write(uint8_t *line_buf, int xpos, int ypos, pixel_color_t color)
 {
-    int x = item->x;
-    int y = item->y;
-    Uint32 fgcolor = uint32_color_to_surface(screen, item->data.text_data.fgcolor);
-    Uint32 bgcolor;
-    bool visible_bg;
-    if (item->brcolor != 0) {
-        bgcolor = uint32_color_to_surface(screen, item->brcolor);
-        visible_bg = true;
-    } else {
-        visible_bg = false;
-    }
-
-    char *text = (char *) item->data.text_data.text;
-
-    int width = item->width;
-
-    int drawn_pixels = 0;
+    UNUSED(ypos);
 
-    Uint32 *pixmem32 = (Uint32 *) (((uint8_t *) screen->pixels) + screen->w * ypos * BPP + xpos * BPP);
-
-    if (width > xpos - x + max_line_len) {
-        width = xpos - x + max_line_len;
-    }
-
-    for (int j = xpos - x; j < width; j++) {
-        int char_index = j / CHAR_WIDTH;
-        char c = text[char_index];
-        unsigned const char *glyph = fontdata + ((unsigned char) c) * 16;
-
-        unsigned char row = glyph[ypos - y];
-
-        bool opaque;
-        int k = j % CHAR_WIDTH;
-        if (row & (1 << (7 - k))) {
-            opaque = true;
-        } else {
-            opaque = false;
-        }
-
-        if (opaque) {
-            pixmem32[drawn_pixels] = fgcolor;
-        } else if (visible_bg) {
-            pixmem32[drawn_pixels] = bgcolor;
-        } else {
-            return drawn_pixels;
-        }
-        drawn_pixels++;
-    }
-
-    return drawn_pixels;
+    ((Uint32 *) line_buf)[xpos] = color;
 }
 
-static int find_max_line_len(BaseDisplayItem *items, int count, int xpos, int ypos)
-{
-    int line_len = screen->w;
-
-    for (int i = 0; i < count; i++) {
-        BaseDisplayItem *item = &items[i];
-
-        if ((xpos < item->x) && (ypos >= item->y) && (ypos < item->y + item->height)) {
-            int len_to_item = item->x - xpos;
-            line_len = (line_len > len_to_item) ? len_to_item : line_len;
-        }
-    }
-
-    return line_len;
-}
+// Partially transparent pixels are blended with what is already in the line buffer.
+#define PIXEL_COMPOSITE
 
-static int draw_x(int xpos, int ypos, BaseDisplayItem *items, int items_count)
+static inline pixel_color_t pixel_read(const uint8_t *line_buf, int xpos, int ypos)
 {
-    bool below = false;
+    UNUSED(ypos);
 
-    for (int i = 0; i < items_count; i++) {
-        BaseDisplayItem *item = &items[i];
-        if ((xpos < item->x) || (xpos >= item->x + item->width) || (ypos < item->y) || (ypos >= item->y + item->height)) {
-            continue;
-        }
+    return ((const Uint32 *) line_buf)[xpos];
+}
 
-        int max_line_len = below ? 1 : find_max_line_len(items, i, xpos, ypos);
+#define ENABLE_IMAGE_CACHE
+#include "../image_cache.h"
 
-        int drawn_pixels = 0;
-        switch (items[i].primitive) {
-            case Image:
-                drawn_pixels = draw_image_x(xpos, ypos, max_line_len, item);
-                break;
-
-            case ScaledCroppedImage:
-                drawn_pixels = draw_scaled_cropped_img_x(xpos, ypos, max_line_len, item);
-                break;
+// images converted to the surface format
+static struct ImageCache image_cache;
 
-            case Rect:
-                drawn_pixels = draw_rect_x(xpos, ypos, max_line_len, item);
-                break;
+#define ENABLE_TEXT_CACHE
+#include "../text_cache.h"
 
-            case Text:
-                drawn_pixels = draw_text_x(xpos, ypos, max_line_len, item);
-                break;
+// text items with registered fonts, rasterized once
+static struct TextCache text_cache;
+// decompressed glyphs of registered fonts
+static UFontGlyphCache *glyph_cache;
 
-            default: {
-                fprintf(stderr, "unexpected display list command.\n");
-            }
-        }
+#include "../draw_common.h"
 
-        if (drawn_pixels != 0) {
-            return drawn_pixels;
-        }
-
-        below = true;
-    }
-
-    return 1;
-}
-
-static void do_update(Context *ctx, term display_list)
+static void draw_damaged()
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
-
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
-
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
-    }
-
-    struct Rectangle damaged;
-    damaged.valid = false;
-    dumb_diff(prev_items, prev_items_len, items, len, &damaged);
-    if (prev_items) {
-        destroy_items(prev_items, prev_items_len);
-        destroy_message(prev_message, ctx->global);
+    image_cache_resolve(&image_cache, scene.items, scene.count);
+    text_cache_resolve(&text_cache, scene.items, scene.count, glyph_cache);
+    if (UNLIKELY(!ufont_text_layout_resolve(scene.items, scene.count, glyph_cache, &frame_arena))) {
+        // damage is kept, so it is redrawn on next update
+        fprintf(stderr, "Failed to allocate text layouts.\n");
+        arena_reset(&frame_arena);
+        return;
     }
-    prev_items = items;
-    prev_items_len = len;
 
-    if (!damaged.valid) {
-        // skip update
+    struct ScanlineIndex index;
+    if (UNLIKELY(!scanline_index_init(&index, scene.items, scene.count, &frame_arena))) {
+        // damage is kept, so it is redrawn on next update
+        fprintf(stderr, "Failed to allocate scanline index.\n");
+        arena_reset(&frame_arena);
         return;
     }
 
-    struct Rectangle screen_rect = {
-        .x = 0,
-        .y = 0,
-        .width = screen->w,
-        .height = screen->h,
-        .valid = true
-    };
-    clip_rectangle(&damaged, &screen_rect);
-
-    // BUG: damage area is not correct
-    // WORKAROUND: always damage the whole screen to force full redraw
-    damaged.x = 0;
-    damaged.y = 0;
-    damaged.height = screen->h;
-    damaged.width = screen->w;
-    // END OF WORKAROUND
-
-    for (int ypos = damaged.y; ypos < damaged.y + damaged.height; ypos++) {
-        int xpos = damaged.x;
-        while (xpos < damaged.x + damaged.width) {
-            int drawn_pixels = draw_x(xpos, ypos, items, len);
-            xpos += drawn_pixels;
+    for (int i = 0; i < damage.rects_count; i++) {
+        struct DamageRect *rect = &damage.rects[i];
+
+        scanline_index_rewind(&index);
+        for (int ypos = rect->y; ypos < rect->y + rect->height; ypos++) {
+            scanline_index_seek(&index, ypos);
+            uint8_t *line_buf = ((uint8_t *) screen->pixels) + screen->w * ypos * BPP;
+            draw_row(line_buf, ypos, &index, rect->x, rect->x + rect->width);
         }
     }
+
+    arena_reset(&frame_arena);
+    damage_region_clear(&damage);
 }
 
 static void process_message(Context *ctx)
 {
     MailboxMessage *mbox_msg = mailbox_take_message(&ctx->mailbox);
     Message *message = CONTAINER_OF(mbox_msg, Message, base);
+    bool retained = false;
 
     GenMessage gen_message;
     if (UNLIKELY(port_parse_gen_message(message->message, &gen_message) != GenCallMessage)) {
@@ -557,17 +233,20 @@ static void process_message(Context *ctx)
 
     term cmd = term_get_tuple_element(req, 0);
 
+    if (cmd == globalcontext_make_atom(ctx->global, "\xA" "load_image")) {
+        // decoded by a worker, that replies and disposes the message, so updates keep being served
+        handle_load_image(image_decoder, image_decode_budget, message, req, gen_message.ref, gen_message.pid, ctx->global);
+        return;
+    }
+
     if (SDL_MUSTLOCK(surface)) {
         if (SDL_LockSurface(surface) < 0) {
             return;
         }
     }
 
-    if (cmd == globalcontext_make_atom(ctx->global, "\x6"
-                                      "update")) {
-        term display_list = term_get_tuple_element(req, 1);
-        do_update(ctx, display_list);
-        prev_message = message;
+    if (scene_handle_command(&scene, ctx, message, req, &damage, &retained)) {
+        draw_damaged();
 
         // Copy and scale up
         int scale = screen->scale;
@@ -591,20 +270,11 @@ static void process_message(Context *ctx)
         // TODO: selective subscribe
         keyboard_pid = gen_message.pid;
 
-    } else if (cmd == globalcontext_make_atom(ctx->global, "\xA" "load_image")) {
-
-        handle_load_image(req, gen_message.ref, gen_message.pid, ctx);
-
-        goto free_msg_and_exit;
-
-    } else if (cmd == globalcontext_make_atom(ctx->global, "\xD" "register_font")) {
-        term font_bin = term_get_tuple_element(req, 2);
-        EpdFont *loaded_font = ufont_parse(term_binary_data(font_bin), term_binary_size(font_bin));
-
-        AtomString handle_atom = globalcontext_atomstring_from_term(ctx->global, term_get_tuple_element(req, 1));
-        char handle[255];
-        atom_string_to_c(handle_atom, handle, sizeof(handle));
-        ufont_manager_register(ufont_manager, handle, loaded_font);
+    } else if (cmd == display_atoms.register_font) {
+        retained = display_items_register_font(fonts, req);
+        if (!retained) {
+            fprintf(stderr, "Failed to register font.\n");
+        }
 
     } else {
         fprintf(stderr, "unexpected command: ");
@@ -637,7 +307,7 @@ invalid_message:
     fprintf(stderr, "Expected gen_server call.\n");
 
 free_msg_and_exit:
-    if (prev_message != message) {
+    if (!retained) {
         destroy_message(message, ctx->global);
     }
     return;
@@ -830,8 +500,39 @@ Context *display_create_port(GlobalContext *global, term opts)
     term width_term = interop_proplist_get_value_default(opts, width_atom, term_from_int(SCREEN_WIDTH));
     term height_term = interop_proplist_get_value_default(opts, height_atom, term_from_int(SCREEN_HEIGHT));
 
+    term max_decodes_term = interop_proplist_get_value_default(opts,
+        globalcontext_make_atom(ctx->global, "\xB" "max_decodes"), term_from_int(IMAGE_DECODER_DEFAULT_MAX_DECODES));
+    term decode_budget_term = interop_proplist_get_value_default(opts,
+        globalcontext_make_atom(ctx->global, "\xD" "decode_budget"), term_from_int(IMAGE_DECODER_DEFAULT_BUDGET));
+    term glyph_cache_size_term = interop_proplist_get_value_default(opts,
+        globalcontext_make_atom(ctx->global, "\x10" "glyph_cache_size"), term_from_int(UFONT_GLYPH_CACHE_DEFAULT_BUDGET));
+    term text_cache_size_term = interop_proplist_get_value_default(opts,
+        globalcontext_make_atom(ctx->global, "\xF" "text_cache_size"), term_from_int(TEXT_CACHE_DEFAULT_SIZE));
+    term image_cache_size_term = interop_proplist_get_value_default(opts,
+        globalcontext_make_atom(ctx->global, "\x10" "image_cache_size"), term_from_int(image_cache_default_size()));
+
     avm_int_t width = term_to_int(width_term);
     avm_int_t height = term_to_int(height_term);
+    avm_int_t max_decodes = term_is_integer(max_decodes_term) ? term_to_int(max_decodes_term) : 0;
+    if (max_decodes <= 0) {
+        max_decodes = IMAGE_DECODER_DEFAULT_MAX_DECODES;
+    }
+    avm_int_t decode_budget = term_is_integer(decode_budget_term) ? term_to_int(decode_budget_term) : 0;
+    if (decode_budget <= 0) {
+        decode_budget = IMAGE_DECODER_DEFAULT_BUDGET;
+    }
+    avm_int_t glyph_cache_size = term_is_integer(glyph_cache_size_term) ? term_to_int(glyph_cache_size_term) : -1;
+    if (glyph_cache_size < 0) {
+        glyph_cache_size = UFONT_GLYPH_CACHE_DEFAULT_BUDGET;
+    }
+    avm_int_t text_cache_size = term_is_integer(text_cache_size_term) ? term_to_int(text_cache_size_term) : -1;
+    if (text_cache_size < 0) {
+        text_cache_size = TEXT_CACHE_DEFAULT_SIZE;
+    }
+    avm_int_t image_cache_size = term_is_integer(image_cache_size_term) ? term_to_int(image_cache_size_term) : -1;
+    if (image_cache_size < 0) {
+        image_cache_size = image_cache_default_size();
+    }
 
     struct DisplayOpts *disp_opts = malloc(sizeof(struct DisplayOpts));
     if (IS_NULL_PTR(disp_opts)) {
@@ -841,7 +542,17 @@ Context *display_create_port(GlobalContext *global, term opts)
     disp_opts->height = height;
     ctx->platform_data = disp_opts;
 
-    UNUSED(opts);
+    display_atoms_init(&display_atoms, global);
+    arena_init(&frame_arena);
+    image_cache_init(&image_cache, global, image_cache_size);
+    text_cache_init(&text_cache, text_cache_size);
+    fonts = ufont_manager_new();
+    scene_init(&scene, global, &display_atoms, fonts);
+    damage_region_init(&damage, width, height);
+    damage_region_mark_all(&damage);
+    image_decode_budget = decode_budget;
+    image_decoder = image_decoder_new(global, max_decodes);
+    glyph_cache = ufont_glyph_cache_new(glyph_cache_size);
 
     pthread_t thread_id;
     pthread_attr_t attr;
@@ -909,8 +620,6 @@ void *display_loop(void *args)
     memset(screen->pixels, 0x80, disp_opts->width * disp_opts->height * BPP);
     memset(surface->pixels, 0x80, disp_opts->width * scale * disp_opts->height * scale * BPP);
 
-    ufont_manager = ufont_manager_new();
-
     if (SDL_MUSTLOCK(surface)) {
         SDL_UnlockSurface(surface);
     }
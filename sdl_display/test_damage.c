@@ -0,0 +1,234 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Host test of damage.h: random edits are applied to a display list, and the damaged area is
+// checked against a full redraw. Every pixel whose stack of items changed must be covered by a
+// damaged rectangle, and damaged rectangles must never overlap.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../display_items.h"
+#include "../damage.h"
+
+#define SCREEN_WIDTH 96
+#define SCREEN_HEIGHT 64
+#define MAX_ITEMS 48
+#define ITERATIONS 2000
+
+static const char *texts[] = { "a", "hello", "hello", "world", "" };
+
+static uint32_t random_state = 1;
+
+static int random_int(int n)
+{
+    // xorshift32, so runs are reproducible on every host
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+
+    return random_state % n;
+}
+
+static void random_item(BaseDisplayItem *item)
+{
+    memset(item, 0, sizeof(BaseDisplayItem));
+    // items can go past the screen edges
+    item->x = random_int(SCREEN_WIDTH + 16) - 8;
+    item->y = random_int(SCREEN_HEIGHT + 16) - 8;
+    // few colors, so that equal items are common
+    item->brcolor = (random_int(4) << 8) | 0xFF;
+
+    if (random_int(3) == 0) {
+        const char *text = texts[random_int(sizeof(texts) / sizeof(texts[0]))];
+        item->primitive = Text;
+        item->width = strlen(text) * 8;
+        item->height = 16;
+        item->data.text_data.fgcolor = 0xFFFFFFFF;
+        item->data.text_data.text = text;
+        item->data.text_data.len = strlen(text);
+    } else {
+        item->primitive = Rect;
+        item->width = random_int(SCREEN_WIDTH / 2);
+        item->height = random_int(SCREEN_HEIGHT / 2);
+    }
+}
+
+static int random_edit(const BaseDisplayItem *orig, int orig_len, BaseDisplayItem *new)
+{
+    memcpy(new, orig, sizeof(BaseDisplayItem) * orig_len);
+    int len = orig_len;
+
+    int edits = 1 + random_int(4);
+    for (int i = 0; i < edits; i++) {
+        int pos = (len > 0) ? random_int(len) : 0;
+
+        switch (random_int(5)) {
+            // insert
+            case 0:
+                if (len < MAX_ITEMS) {
+                    memmove(&new[pos + 1], &new[pos], sizeof(BaseDisplayItem) * (len - pos));
+                    random_item(&new[pos]);
+                    len++;
+                }
+                break;
+
+            // remove
+            case 1:
+                if (len > 0) {
+                    memmove(&new[pos], &new[pos + 1], sizeof(BaseDisplayItem) * (len - pos - 1));
+                    len--;
+                }
+                break;
+
+            // move to another depth
+            case 2:
+                if (len > 1) {
+                    BaseDisplayItem moved = new[pos];
+                    memmove(&new[pos], &new[pos + 1], sizeof(BaseDisplayItem) * (len - pos - 1));
+                    int to = random_int(len);
+                    memmove(&new[to + 1], &new[to], sizeof(BaseDisplayItem) * (len - 1 - to));
+                    new[to] = moved;
+                }
+                break;
+
+            // move on the screen
+            case 3:
+                if (len > 0) {
+                    new[pos].x += random_int(9) - 4;
+                    new[pos].y += random_int(9) - 4;
+                }
+                break;
+
+            // recolor
+            default:
+                if (len > 0) {
+                    new[pos].brcolor = (random_int(4) << 8) | 0xFF;
+                }
+                break;
+        }
+    }
+
+    return len;
+}
+
+static bool item_covers(const BaseDisplayItem *item, int x, int y)
+{
+    return (x >= item->x) && (x < item->x + item->width) && (y >= item->y) && (y < item->y + item->height);
+}
+
+// Pixels are the same after a full redraw when the items covering them are equal, in the same order.
+static bool same_stack(BaseDisplayItem *orig, int orig_len, BaseDisplayItem *new, int new_len, int x, int y)
+{
+    int i = 0;
+    int j = 0;
+    while (true) {
+        while (i < orig_len && !item_covers(&orig[i], x, y)) {
+            i++;
+        }
+        while (j < new_len && !item_covers(&new[j], x, y)) {
+            j++;
+        }
+        if (i == orig_len || j == new_len) {
+            return (i == orig_len) && (j == new_len);
+        }
+        if (!cmp_display_item(&orig[i], &new[j])) {
+            return false;
+        }
+        i++;
+        j++;
+    }
+}
+
+static bool region_covers(const struct DamageRegion *region, int x, int y)
+{
+    for (int i = 0; i < region->rects_count; i++) {
+        const struct DamageRect *rect = &region->rects[i];
+        if (x >= rect->x && x < rect->x + rect->width && y >= rect->y && y < rect->y + rect->height) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool check_region(const struct DamageRegion *region, int iteration)
+{
+    for (int i = 0; i < region->rects_count; i++) {
+        const struct DamageRect *rect = &region->rects[i];
+        if (rect->width <= 0 || rect->height <= 0 || rect->x < 0 || rect->y < 0
+            || rect->x + rect->width > SCREEN_WIDTH || rect->y + rect->height > SCREEN_HEIGHT) {
+            fprintf(stderr, "iteration %i: rect %i is empty or off screen\n", iteration, i);
+            return false;
+        }
+        for (int j = i + 1; j < region->rects_count; j++) {
+            if (damage_rect_intersects(rect, &region->rects[j])) {
+                fprintf(stderr, "iteration %i: rects %i and %i overlap\n", iteration, i, j);
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+int main()
+{
+    static BaseDisplayItem lists[2][MAX_ITEMS];
+    BaseDisplayItem *orig = lists[0];
+    BaseDisplayItem *new = lists[1];
+    int orig_len = 0;
+    long damaged_pixels = 0;
+
+    for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+        int new_len = random_edit(orig, orig_len, new);
+
+        struct DamageRegion region;
+        damage_region_init(&region, SCREEN_WIDTH, SCREEN_HEIGHT);
+        damage_region_diff(&region, orig, orig_len, new, new_len);
+
+        if (!check_region(&region, iteration)) {
+            return EXIT_FAILURE;
+        }
+
+        for (int y = 0; y < SCREEN_HEIGHT; y++) {
+            for (int x = 0; x < SCREEN_WIDTH; x++) {
+                bool covered = region_covers(&region, x, y);
+                if (!covered && !same_stack(orig, orig_len, new, new_len, x, y)) {
+                    fprintf(stderr, "iteration %i: pixel %i, %i changed but it is not damaged\n", iteration, x, y);
+                    return EXIT_FAILURE;
+                }
+                damaged_pixels += covered;
+            }
+        }
+
+        BaseDisplayItem *tmp = orig;
+        orig = new;
+        new = tmp;
+        orig_len = new_len;
+    }
+
+    printf("%i frames, %li damaged pixels per frame\n", ITERATIONS, damaged_pixels / ITERATIONS);
+
+    return EXIT_SUCCESS;
+}
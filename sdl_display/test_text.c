@@ -0,0 +1,172 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+// Host test of ufont text drawn by draw_common.h with the monochrome.h pixel traits, that are used
+// by the memory LCD and SSD1306 drivers: coverage levels are looked up as RGBA8888 colors, so
+// anti-aliased edges are dithered, and over a transparent background half covered pixels are drawn.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ufontlib.h"
+
+#define ENABLE_UFONT
+
+#define CHAR_WIDTH 8
+#define DISPLAY_WIDTH 64
+#define CHECK_OVERFLOW 1
+
+#include "../font.c"
+
+#include "../display_items.h"
+#include "../monochrome.h"
+#include "../draw_common.h"
+
+#define GLYPH_SIZE 8
+// bytes of a glyph bitmap, 2 pixels for each byte
+#define GLYPH_BYTES (GLYPH_SIZE * GLYPH_SIZE / 2)
+
+// 'A' is fully covered, 'B' is covered by 7/15
+static uint8_t glyph_bitmaps[GLYPH_BYTES * 2];
+
+static const EpdGlyph glyphs[] = {
+    { GLYPH_SIZE, GLYPH_SIZE, GLYPH_SIZE, 0, GLYPH_SIZE, 0, 0 },
+    { GLYPH_SIZE, GLYPH_SIZE, GLYPH_SIZE, 0, GLYPH_SIZE, 0, GLYPH_BYTES },
+};
+
+static const EpdUnicodeInterval intervals[] = {
+    { 'A', 'B', 0 },
+};
+
+static const EpdFont test_font = {
+    .bitmap = glyph_bitmaps,
+    .glyph = glyphs,
+    .intervals = intervals,
+    .interval_count = 1,
+    .compressed = false,
+    .advance_y = GLYPH_SIZE,
+    .ascender = GLYPH_SIZE,
+    .descender = 0,
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static int pixel_at(const uint8_t *line_buf, int x)
+{
+    return (line_buf[x / 8] >> (x % 8)) & 1;
+}
+
+// Draws the text item into a framebuffer of GLYPH_SIZE rows, that starts filled with fill.
+static void draw_text_rows(BaseDisplayItem *item, uint8_t fill, uint8_t rows[GLYPH_SIZE][DISPLAY_WIDTH / 8])
+{
+    struct Arena arena;
+    arena_init(&arena);
+
+    if (!ufont_text_layout_resolve(item, 1, NULL, &arena)) {
+        check(false, "text layout allocation");
+    }
+
+    for (int y = 0; y < GLYPH_SIZE; y++) {
+        memset(rows[y], fill, DISPLAY_WIDTH / 8);
+        draw_item_x(rows[y], item->x, y, item->width, item);
+    }
+
+    arena_destroy(&arena);
+}
+
+// Counts white pixels of glyph columns [x0, x0 + GLYPH_SIZE).
+static int count_white(uint8_t rows[GLYPH_SIZE][DISPLAY_WIDTH / 8], int x0)
+{
+    int white = 0;
+    for (int y = 0; y < GLYPH_SIZE; y++) {
+        for (int x = x0; x < x0 + GLYPH_SIZE; x++) {
+            white += pixel_at(rows[y], x);
+        }
+    }
+
+    return white;
+}
+
+int main(void)
+{
+    memset(glyph_bitmaps, 0xFF, GLYPH_BYTES);
+    memset(glyph_bitmaps + GLYPH_BYTES, 0x77, GLYPH_BYTES);
+
+    BaseDisplayItem item;
+    memset(&item, 0, sizeof(item));
+    item.primitive = Text;
+    item.x = 0;
+    item.y = 0;
+    item.width = GLYPH_SIZE * 2;
+    item.height = GLYPH_SIZE;
+    item.data.text_data.fgcolor = 0x000000FF;
+    item.data.text_data.text = "AB";
+    item.data.text_data.len = 2;
+    item.data.text_data.ufont = &test_font;
+    item.data.text_data.baseline = GLYPH_SIZE;
+
+    uint8_t rows[GLYPH_SIZE][DISPLAY_WIDTH / 8];
+
+    // black text over a white background, on a black framebuffer
+    item.brcolor = 0xFFFFFFFF;
+    draw_text_rows(&item, 0x00, rows);
+    check(count_white(rows, 0) == 0, "fully covered glyph is black");
+    int white = count_white(rows, GLYPH_SIZE);
+    // 7/15 of black over white is dithered to about half white pixels
+    check(white >= 16 && white <= 48, "partially covered glyph is dithered");
+    bool outside = true;
+    for (int y = 0; y < GLYPH_SIZE; y++) {
+        for (int x = GLYPH_SIZE * 2; x < DISPLAY_WIDTH; x++) {
+            outside = outside && pixel_at(rows[y], x) == 0;
+        }
+    }
+    check(outside, "pixels outside of the item are left untouched");
+
+    // black text over a transparent background, on a white framebuffer
+    item.brcolor = 0;
+    draw_text_rows(&item, 0xFF, rows);
+    check(count_white(rows, 0) == 0, "fully covered glyph is black over a transparent background");
+    check(count_white(rows, GLYPH_SIZE) == GLYPH_SIZE * GLYPH_SIZE,
+        "less than half covered glyph is not drawn over a transparent background");
+
+    // 8/15 is drawn over a transparent background
+    memset(glyph_bitmaps + GLYPH_BYTES, 0x88, GLYPH_BYTES);
+    draw_text_rows(&item, 0xFF, rows);
+    check(count_white(rows, GLYPH_SIZE) == 0, "half covered glyph is drawn over a transparent background");
+
+    if (failures) {
+        fprintf(stderr, "%i checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}
@@ -31,7 +31,13 @@
 
 #include <i2c_driver.h>
 
+#include "arena.h"
+#include "display_atoms.h"
 #include "display_common.h"
+#include "ufontlib.h"
+
+// fonts registered with register_font, text items look them up while they are parsed
+#define ENABLE_UFONT
 
 #define TAG "SSD1306"
 
@@ -59,49 +65,70 @@ struct SPI
     term i2c_host;
     bool is_sh1106;
     Context *ctx;
+    struct DisplayAtoms atoms;
+    struct Arena arena;
+    // fonts registered with register_font, and their decompressed glyphs
+    UFontManager *fonts;
+    UFontGlyphCache *glyph_cache;
 };
 
-static void do_update(Context *ctx, term display_list);
+static void do_update(Context *ctx, term req);
 
 #include "font.c"
 #include "display_items.h"
-#include "draw_common.h"
+#include "display_list.h"
 #include "monochrome.h"
+#include "draw_common.h"
 #include "message_helpers.h"
 
-static void do_update(Context *ctx, term display_list)
+static void do_update(Context *ctx, term req)
 {
-    int proper;
-    int len = term_list_length(display_list, &proper);
+    struct SPI *spi = ctx->platform_data;
+
+    // items, their text and the scanline index live until the end of the frame
+    int len;
+    BaseDisplayItem *items = display_list_parse(req, ctx, &spi->atoms, spi->fonts, &spi->arena, &len);
+    if (IS_NULL_PTR(items)) {
+        fprintf(stderr, "Failed to parse display list.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
 
-    BaseDisplayItem *items = malloc(sizeof(BaseDisplayItem) * len);
+    if (UNLIKELY(!ufont_text_layout_resolve(items, len, spi->glyph_cache, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate text layouts.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
 
-    term t = display_list;
-    for (int i = 0; i < len; i++) {
-        init_item(&items[i], term_get_list_head(t), ctx);
-        t = term_get_list_tail(t);
+    struct ScanlineIndex index;
+    if (UNLIKELY(!scanline_index_init(&index, items, len, &spi->arena))) {
+        fprintf(stderr, "Failed to allocate scanline index.\n");
+        arena_reset(&spi->arena);
+        return;
     }
 
     int screen_width = DISPLAY_WIDTH;
     int screen_height = DISPLAY_HEIGHT;
-    struct SPI *spi = ctx->platform_data;
 
     int memsize = (DISPLAY_WIDTH * (PAGE_HEIGHT + 1)) / sizeof(uint8_t);
-    uint8_t *buf = malloc(memsize);
+    uint8_t *buf = arena_alloc(&spi->arena, memsize);
+    if (IS_NULL_PTR(buf)) {
+        fprintf(stderr, "Failed to allocate page buffer.\n");
+        arena_reset(&spi->arena);
+        return;
+    }
     memset(buf, 0, memsize);
 
     i2c_port_t i2c_num;
     if (i2c_driver_acquire(spi->i2c_host, &i2c_num, ctx->global) != I2CAcquireOk) {
         fprintf(stderr, "Invalid I2C peripheral\n");
+        arena_reset(&spi->arena);
         return;
     }
 
     for (int ypos = 0; ypos < screen_height; ypos++) {
-        int xpos = 0;
-        while (xpos < screen_width) {
-            int drawn_pixels = draw_x(buf, xpos, ypos, items, len);
-            xpos += drawn_pixels;
-        }
+        scanline_index_seek(&index, ypos);
+        draw_row(buf, ypos, &index, 0, screen_width);
 
         uint8_t *out_buf = buf + (DISPLAY_WIDTH / 8);
         for (int i = 0; i < DISPLAY_WIDTH; i++) {
@@ -153,8 +180,7 @@ static void do_update(Context *ctx, term display_list)
 
     i2c_driver_release(spi->i2c_host, ctx->global);
 
-    free(buf);
-    destroy_items(items, len);
+    arena_reset(&spi->arena);
 }
 
 static void display_init(Context *ctx, term opts)
@@ -176,6 +202,15 @@ static void display_init(Context *ctx, term opts)
     ctx->platform_data = spi;
 
     spi->ctx = ctx;
+    display_atoms_init(&spi->atoms, ctx->global);
+    arena_init(&spi->arena);
+    spi->fonts = ufont_manager_new();
+    term glyph_cache_size = interop_kv_get_value_default(opts, ATOM_STR("\x10", "glyph_cache_size"),
+        term_from_int(UFONT_GLYPH_CACHE_DEFAULT_BUDGET), ctx->global);
+    // without a cache glyphs are inflated each frame
+    spi->glyph_cache = ufont_glyph_cache_new((term_is_integer(glyph_cache_size) && term_to_int(glyph_cache_size) >= 0)
+            ? term_to_int(glyph_cache_size)
+            : UFONT_GLYPH_CACHE_DEFAULT_BUDGET);
 
     term compat_value_term = interop_kv_get_value_default(opts, ATOM_STR("\xA", "compatible"), term_nil(), ctx->global);
     int str_ok;
@@ -0,0 +1,314 @@
+/*
+ * This file is part of AtomGL.
+ *
+ * Copyright 2024 Davide Bettio <davide@uninstall.it>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef _TEXT_CACHE_H_
+#define _TEXT_CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <utils.h>
+
+#include "arena.h"
+
+// ufontlib.h and display_items.h must be included before this file, with ENABLE_UFONT defined.
+// Drivers that use the cache define ENABLE_TEXT_CACHE before including draw_common.h.
+
+#define TEXT_CACHE_DEFAULT_SIZE (16 * 1024)
+
+// Coverage of a whole text item, laid out and rasterized once, so that labels that do not change
+// are drawn without walking their glyphs again. Coverage does not depend on colors, that are
+// applied while drawing, so the key is just the font and the text.
+struct TextCacheEntry
+{
+    struct TextCacheEntry *prev;
+    struct TextCacheEntry *next;
+
+    // key: the text is copied at the end of the entry, since items do not outlive their message
+    const EpdFont *font;
+    const char *text;
+    int len;
+    uint32_t hash;
+
+    int width;
+    int height;
+    // 4 bits per pixel, first pixel in the low nibble, like glyph bitmaps
+    int stride;
+    uint8_t *coverage;
+
+    size_t size;
+    uint32_t last_used;
+};
+
+// LRU cache of rasterized text, that is bounded by budget bytes.
+struct TextCache
+{
+    // most recently used first
+    struct TextCacheEntry *head;
+    struct TextCacheEntry *tail;
+    size_t used;
+    size_t budget;
+    uint32_t frame;
+};
+
+static void text_cache_init(struct TextCache *cache, size_t budget)
+{
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->used = 0;
+    cache->budget = budget;
+    cache->frame = 0;
+}
+
+static void text_cache_unlink(struct TextCache *cache, struct TextCacheEntry *entry)
+{
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        cache->tail = entry->prev;
+    }
+}
+
+static void text_cache_push_front(struct TextCache *cache, struct TextCacheEntry *entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head) {
+        cache->head->prev = entry;
+    } else {
+        cache->tail = entry;
+    }
+    cache->head = entry;
+}
+
+static void text_cache_release(struct TextCache *cache, struct TextCacheEntry *entry)
+{
+    text_cache_unlink(cache, entry);
+    cache->used -= entry->size;
+    free(entry);
+}
+
+// FNV-1a, so that most entries are told apart without comparing their text
+static uint32_t text_cache_hash(const EpdFont *font, const char *text, int len)
+{
+    uint32_t hash = 2166136261U ^ (uint32_t) (uintptr_t) font;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ (uint8_t) text[i]) * 16777619U;
+    }
+
+    return hash;
+}
+
+static struct TextCacheEntry *text_cache_find(struct TextCache *cache, const EpdFont *font, const char *text,
+    int len, uint32_t hash)
+{
+    for (struct TextCacheEntry *entry = cache->head; entry; entry = entry->next) {
+        if (entry->hash == hash && entry->font == font && entry->len == len && !memcmp(entry->text, text, len)) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+// Evicts least recently used entries until size bytes are available. Entries used in the current
+// frame are never evicted, since items are pointing to them.
+static bool text_cache_make_room(struct TextCache *cache, size_t size)
+{
+    if (size > cache->budget) {
+        return false;
+    }
+
+    while (cache->used + size > cache->budget) {
+        struct TextCacheEntry *lru = cache->tail;
+        if (!lru || lru->last_used == cache->frame) {
+            return false;
+        }
+        text_cache_release(cache, lru);
+    }
+
+    return true;
+}
+
+// Lays out text as ufont_text_layout_new does. Where glyphs overlap the highest coverage is kept,
+// like draw_ufont_text_x does, so text looks the same whether it is in the cache or not.
+static bool text_cache_rasterize(struct TextCacheEntry *entry, int baseline, UFontGlyphCache *glyph_cache)
+{
+    const EpdFont *font = entry->font;
+    const char *text = entry->text;
+    int cursor_x = 0;
+    uint32_t cp;
+    while ((cp = ufont_next_code_point(&text))) {
+        if (cp == '\n') {
+            cursor_x = 0;
+            baseline += font->advance_y;
+            continue;
+        }
+
+        const EpdGlyph *glyph = epd_get_glyph(font, cp);
+        if (!glyph) {
+            // default fallback glyph
+            glyph = epd_get_glyph(font, 0);
+            if (!glyph) {
+                continue;
+            }
+        }
+
+        int glyph_x = cursor_x + glyph->left;
+        int glyph_y = baseline - glyph->top;
+        cursor_x += glyph->advance_x;
+        if (glyph->width == 0 || glyph->height == 0 || glyph_x >= entry->width || glyph_x + glyph->width <= 0
+            || glyph_y >= entry->height || glyph_y + glyph->height <= 0) {
+            continue;
+        }
+
+        uint8_t *to_free;
+        const uint8_t *bitmap = ufont_glyph_bitmap(glyph_cache, font, glyph, &to_free);
+        if (IS_NULL_PTR(bitmap)) {
+            return false;
+        }
+
+        int first_x = (glyph_x < 0) ? -glyph_x : 0;
+        int last_x = (entry->width - glyph_x < glyph->width) ? entry->width - glyph_x : glyph->width;
+        int first_y = (glyph_y < 0) ? -glyph_y : 0;
+        int last_y = (entry->height - glyph_y < glyph->height) ? entry->height - glyph_y : glyph->height;
+        for (int j = first_y; j < last_y; j++) {
+            const uint8_t *row = bitmap + j * ((glyph->width + 1) / 2);
+            uint8_t *out = entry->coverage + (glyph_y + j) * entry->stride;
+            for (int i = first_x; i < last_x; i++) {
+                uint8_t coverage = (i & 1) ? (row[i / 2] >> 4) : (row[i / 2] & 0xF);
+                int x = glyph_x + i;
+                uint8_t current = (x & 1) ? (out[x / 2] >> 4) : (out[x / 2] & 0xF);
+                if (coverage > current) {
+                    out[x / 2] = (x & 1) ? ((out[x / 2] & 0x0F) | (coverage << 4)) : ((out[x / 2] & 0xF0) | coverage);
+                }
+            }
+        }
+
+        free(to_free);
+    }
+
+    return true;
+}
+
+static struct TextCacheEntry *text_cache_create(struct TextCache *cache, const BaseDisplayItem *item,
+    uint32_t hash, UFontGlyphCache *glyph_cache)
+{
+    const struct TextData *text_data = &item->data.text_data;
+    if (item->width <= 0 || item->height <= 0) {
+        return NULL;
+    }
+
+    int stride = (item->width + 1) / 2;
+    size_t coverage_size = (size_t) stride * item->height;
+    size_t size = arena_align(sizeof(struct TextCacheEntry)) + coverage_size + text_data->len + 1;
+    if (!text_cache_make_room(cache, size)) {
+        return NULL;
+    }
+
+    uint8_t *block = malloc(size);
+    if (IS_NULL_PTR(block)) {
+        return NULL;
+    }
+
+    struct TextCacheEntry *entry = (struct TextCacheEntry *) block;
+    block += arena_align(sizeof(struct TextCacheEntry));
+    entry->coverage = block;
+    memset(entry->coverage, 0, coverage_size);
+    block += coverage_size;
+    memcpy(block, text_data->text, text_data->len);
+    block[text_data->len] = '\0';
+    entry->text = (const char *) block;
+    entry->font = text_data->ufont;
+    entry->len = text_data->len;
+    entry->hash = hash;
+    entry->width = item->width;
+    entry->height = item->height;
+    entry->stride = stride;
+    entry->size = size;
+    entry->last_used = cache->frame;
+
+    if (!text_cache_rasterize(entry, text_data->baseline, glyph_cache)) {
+        free(entry);
+        return NULL;
+    }
+
+    cache->used += size;
+    text_cache_push_front(cache, entry);
+
+    return entry;
+}
+
+// Looks up the rasterized copy of every text item that uses a registered font, rasterizing the ones
+// that are not in the cache yet. It must be called once per frame, before drawing: pointers are
+// valid until next call. Items without a rasterized copy are drawn glyph by glyph.
+// Fonts are never replaced once registered, so the font pointer is enough to tell them apart. Glyphs
+// of new entries are taken from glyph_cache, that belongs to the same display.
+static void text_cache_resolve(struct TextCache *cache, BaseDisplayItem *items, int count,
+    UFontGlyphCache *glyph_cache)
+{
+    cache->frame++;
+
+    for (int i = 0; i < count; i++) {
+        BaseDisplayItem *item = &items[i];
+        if (item->primitive != Text || !item->data.text_data.ufont) {
+            continue;
+        }
+
+        struct TextData *text_data = &item->data.text_data;
+        text_data->rendered = NULL;
+        if (cache->budget == 0) {
+            continue;
+        }
+
+        uint32_t hash = text_cache_hash(text_data->ufont, text_data->text, text_data->len);
+        struct TextCacheEntry *entry = text_cache_find(cache, text_data->ufont, text_data->text, text_data->len, hash);
+        if (entry) {
+            text_cache_unlink(cache, entry);
+            text_cache_push_front(cache, entry);
+        } else {
+            entry = text_cache_create(cache, item, hash, glyph_cache);
+            if (!entry) {
+                continue;
+            }
+        }
+
+        entry->last_used = cache->frame;
+        text_data->rendered = entry;
+    }
+}
+
+static void text_cache_destroy(struct TextCache *cache)
+{
+    while (cache->head) {
+        text_cache_release(cache, cache->head);
+    }
+}
+
+#endif
@@ -24,12 +24,28 @@
 #include "ufontlib.h"
 #ifdef WITH_ZLIB
 #include <zlib.h>
+#elif defined(ESP_PLATFORM)
+// tinfl is part of the ROM
+#include <sdkconfig.h>
+#if defined(CONFIG_IDF_TARGET_ESP32)
+#include <esp32/rom/miniz.h>
+#elif defined(CONFIG_IDF_TARGET_ESP32S2)
+#include <esp32s2/rom/miniz.h>
+#elif defined(CONFIG_IDF_TARGET_ESP32S3)
+#include <esp32s3/rom/miniz.h>
+#elif defined(CONFIG_IDF_TARGET_ESP32C3)
+#include <esp32c3/rom/miniz.h>
+#else
+// there is no inflater in the ROM of this target, so only uncompressed fonts can be loaded
+#define UFONT_NO_INFLATE
+#endif
 #else
 #include "miniz.c"
 #include "miniz.h"
 #endif
 #include <assert.h>
 #include <math.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -97,7 +113,8 @@ static uint32_t next_cp(const uint8_t **string)
 EpdFontProperties epd_font_properties_default()
 {
     EpdFontProperties props = {
-        .fg_color = 0, .bg_color = 15, .fallback_glyph = 0, .flags = EPD_DRAW_ALIGN_LEFT
+        .fg_color = 0, .bg_color = 15, .fallback_glyph = 0, .flags = EPD_DRAW_ALIGN_LEFT,
+        .glyph_cache = NULL
     };
     return props;
 }
@@ -117,9 +134,17 @@ const EpdGlyph *epd_get_glyph(const EpdFont *font, uint32_t code_point)
     return NULL;
 }
 
+#if !defined(WITH_ZLIB) && !defined(UFONT_NO_INFLATE)
+// tinfl keeps its state in a decompressor that is too big for task stacks
+#define UFONT_TINFL
+#endif
+
 #ifdef WITH_ZLIB
-static int do_uncompress(uint8_t *dest, size_t uncompressed_size, const uint8_t *source, size_t source_size)
+static int do_uncompress(UFontGlyphCache *cache, uint8_t *dest, size_t uncompressed_size, const uint8_t *source,
+    size_t source_size)
 {
+    (void) cache;
+
     if (uncompressed_size == 0 || dest == NULL || source_size == 0 || source == NULL) {
         return -1;
     }
@@ -147,18 +172,40 @@ static int do_uncompress(uint8_t *dest, size_t uncompressed_size, const uint8_t
 
     return 0;
 }
-#else
-static int do_uncompress(uint8_t *dest, size_t uncompressed_size, const uint8_t *source, size_t source_size)
+#elif defined(UFONT_NO_INFLATE)
+static int do_uncompress(UFontGlyphCache *cache, uint8_t *dest, size_t uncompressed_size, const uint8_t *source,
+    size_t source_size)
 {
-    static tinfl_decompressor decomp;
+    (void) cache;
+    (void) dest;
+    (void) uncompressed_size;
+    (void) source;
+    (void) source_size;
+
+    return -1;
+}
+#else
+static tinfl_decompressor *glyph_cache_decompressor(UFontGlyphCache *cache);
 
+static int do_uncompress(UFontGlyphCache *cache, uint8_t *dest, size_t uncompressed_size, const uint8_t *source,
+    size_t source_size)
+{
     if (uncompressed_size == 0 || dest == NULL || source_size == 0 || source == NULL) {
         return -1;
     }
-    tinfl_init(&decomp);
+
+    // each cache has its own decompressor, so caches can be used by different tasks
+    tinfl_decompressor *decomp = cache ? glyph_cache_decompressor(cache) : malloc(sizeof(tinfl_decompressor));
+    if (decomp == NULL) {
+        return -1;
+    }
+    tinfl_init(decomp);
 
     // we know everything will fit into the buffer.
-    tinfl_status decomp_status = tinfl_decompress(&decomp, source, &source_size, dest, dest, &uncompressed_size, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    tinfl_status decomp_status = tinfl_decompress(decomp, source, &source_size, dest, dest, &uncompressed_size, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    if (!cache) {
+        free(decomp);
+    }
     if (decomp_status != TINFL_STATUS_DONE) {
         return decomp_status;
     }
@@ -166,6 +213,256 @@ static int do_uncompress(uint8_t *dest, size_t uncompressed_size, const uint8_t
 }
 #endif
 
+#define GET_LIST_ENTRY(list_item, type, list_head_member) \
+    ((type *) (((char *) (list_item)) - ((unsigned long) &((type *) 0)->list_head_member)))
+
+#define LIST_FOR_EACH(item, head) \
+    for (item = (head)->next; item != (head); item = item->next)
+
+#define MUTABLE_LIST_FOR_EACH(item, tmp, head) \
+    for (item = (head)->next, tmp = item->next; item != (head); item = tmp, tmp = item->next)
+
+struct UFListHead;
+
+struct UFListHead
+{
+    struct UFListHead *next;
+    struct UFListHead *prev;
+};
+
+static inline void uflist_insert(struct UFListHead *new_item, struct UFListHead *prev_head, struct UFListHead *next_head)
+{
+    new_item->prev = prev_head;
+    new_item->next = next_head;
+    next_head->prev = new_item;
+    prev_head->next = new_item;
+}
+
+static inline void uflist_append(struct UFListHead *head, struct UFListHead *new_item)
+{
+    uflist_insert(new_item, head->prev, head);
+}
+
+static inline void uflist_remove(struct UFListHead *remove_item)
+{
+    remove_item->prev->next = remove_item->next;
+    remove_item->next->prev = remove_item->prev;
+}
+
+static inline void uflist_init(struct UFListHead *list_item)
+{
+    list_item->prev = list_item;
+    list_item->next = list_item;
+}
+
+/*
+ * Glyph cache: decompressed bitmaps of compressed fonts, keyed by glyph (that is unique for a
+ * font and code point), least recently used glyphs are evicted when the budget is exceeded.
+ * Caches are not shared, so each display owns its own one and no locking is needed.
+ */
+#define UF_GLYPH_CACHE_BUCKETS 256
+
+typedef struct UFGlyphCacheEntry
+{
+    struct UFListHead lru_head;
+    struct UFGlyphCacheEntry *bucket_next;
+    const EpdGlyph *glyph;
+    size_t size;
+    // last frame that used the bitmap
+    uint32_t frame;
+    uint8_t bitmap[];
+} UFGlyphCacheEntry;
+
+struct UFontGlyphCache
+{
+    UFGlyphCacheEntry *buckets[UF_GLYPH_CACHE_BUCKETS];
+    // most recently used first
+    struct UFListHead lru;
+    size_t used;
+    size_t budget;
+    uint32_t frame;
+#ifdef UFONT_TINFL
+    tinfl_decompressor decomp;
+#endif
+};
+
+#ifdef UFONT_TINFL
+static tinfl_decompressor *glyph_cache_decompressor(UFontGlyphCache *cache)
+{
+    return &cache->decomp;
+}
+#endif
+
+static inline unsigned int glyph_cache_bucket(const EpdGlyph *glyph)
+{
+    // glyphs of a font are contiguous
+    return ((uintptr_t) glyph / sizeof(EpdGlyph)) % UF_GLYPH_CACHE_BUCKETS;
+}
+
+UFontGlyphCache *ufont_glyph_cache_new(size_t budget)
+{
+    UFontGlyphCache *cache = malloc(sizeof(UFontGlyphCache));
+    if (cache == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < UF_GLYPH_CACHE_BUCKETS; i++) {
+        cache->buckets[i] = NULL;
+    }
+    uflist_init(&cache->lru);
+    cache->used = 0;
+    cache->budget = budget;
+    cache->frame = 0;
+
+    return cache;
+}
+
+static void glyph_cache_remove(UFontGlyphCache *cache, UFGlyphCacheEntry *entry)
+{
+    UFGlyphCacheEntry **bucket_entry = &cache->buckets[glyph_cache_bucket(entry->glyph)];
+    while (*bucket_entry != entry) {
+        bucket_entry = &(*bucket_entry)->bucket_next;
+    }
+    *bucket_entry = entry->bucket_next;
+
+    uflist_remove(&entry->lru_head);
+    cache->used -= entry->size;
+    free(entry);
+}
+
+void ufont_glyph_cache_destroy(UFontGlyphCache *cache)
+{
+    if (cache == NULL) {
+        return;
+    }
+    while (cache->lru.next != &cache->lru) {
+        glyph_cache_remove(cache, GET_LIST_ENTRY(cache->lru.next, UFGlyphCacheEntry, lru_head));
+    }
+    free(cache);
+}
+
+void ufont_glyph_cache_next_frame(UFontGlyphCache *cache)
+{
+    if (cache) {
+        cache->frame++;
+    }
+}
+
+/*
+ * Evicts least recently used glyphs until size bytes are available, glyphs used in the current
+ * frame are never evicted, since their bitmaps might still be in use.
+ */
+static bool glyph_cache_make_room(UFontGlyphCache *cache, size_t size)
+{
+    if (size > cache->budget) {
+        return false;
+    }
+
+    while (cache->used + size > cache->budget) {
+        if (cache->lru.prev == &cache->lru) {
+            return false;
+        }
+        UFGlyphCacheEntry *lru = GET_LIST_ENTRY(cache->lru.prev, UFGlyphCacheEntry, lru_head);
+        if (lru->frame == cache->frame) {
+            return false;
+        }
+        glyph_cache_remove(cache, lru);
+    }
+
+    return true;
+}
+
+static const uint8_t *glyph_uncompress_temporary(UFontGlyphCache *cache, const EpdFont *font,
+    const EpdGlyph *glyph, size_t bitmap_size, uint8_t **to_free)
+{
+    uint8_t *tmp_bitmap = malloc(bitmap_size);
+    if (tmp_bitmap == NULL) {
+        return NULL;
+    }
+    if (do_uncompress(cache, tmp_bitmap, bitmap_size, &font->bitmap[glyph->data_offset], glyph->compressed_size)) {
+        free(tmp_bitmap);
+        return NULL;
+    }
+    *to_free = tmp_bitmap;
+    return tmp_bitmap;
+}
+
+/*
+ * Returns the decompressed bitmap of glyph, when it doesn't fit the cache (or there is no cache) a
+ * temporary bitmap is returned, and *to_free is set to it.
+ */
+static const uint8_t *glyph_cache_get(UFontGlyphCache *cache, const EpdFont *font, const EpdGlyph *glyph,
+    size_t bitmap_size, uint8_t **to_free)
+{
+    *to_free = NULL;
+
+    if (cache == NULL) {
+        return glyph_uncompress_temporary(NULL, font, glyph, bitmap_size, to_free);
+    }
+
+    unsigned int bucket = glyph_cache_bucket(glyph);
+    for (UFGlyphCacheEntry *entry = cache->buckets[bucket]; entry; entry = entry->bucket_next) {
+        if (entry->glyph == glyph) {
+            uflist_remove(&entry->lru_head);
+            uflist_insert(&entry->lru_head, &cache->lru, cache->lru.next);
+            entry->frame = cache->frame;
+            return entry->bitmap;
+        }
+    }
+
+    size_t entry_size = sizeof(UFGlyphCacheEntry) + bitmap_size;
+    if (!glyph_cache_make_room(cache, entry_size)) {
+        return glyph_uncompress_temporary(cache, font, glyph, bitmap_size, to_free);
+    }
+
+    UFGlyphCacheEntry *entry = malloc(entry_size);
+    if (entry == NULL) {
+        return NULL;
+    }
+    if (do_uncompress(cache, entry->bitmap, bitmap_size, &font->bitmap[glyph->data_offset], glyph->compressed_size)) {
+        // not cached, so a later draw can retry
+        free(entry);
+        return NULL;
+    }
+    entry->glyph = glyph;
+    entry->size = entry_size;
+    entry->frame = cache->frame;
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    uflist_insert(&entry->lru_head, &cache->lru, cache->lru.next);
+    cache->used += entry_size;
+
+    return entry->bitmap;
+}
+
+const uint8_t *ufont_glyph_bitmap(UFontGlyphCache *cache, const EpdFont *font, const EpdGlyph *glyph,
+    uint8_t **to_free)
+{
+    if (!font->compressed) {
+        *to_free = NULL;
+        return &font->bitmap[glyph->data_offset];
+    }
+
+    size_t bitmap_size = (size_t) (glyph->width / 2 + glyph->width % 2) * glyph->height;
+    return glyph_cache_get(cache, font, glyph, bitmap_size, to_free);
+}
+
+uint32_t ufont_next_code_point(const char **string)
+{
+    return next_cp((const uint8_t **) string);
+}
+
+/*
+ * Ports that draw text with epd_write_string provide their own epd_draw_pixel, the others render
+ * glyphs on their own, so they do not need to.
+ */
+__attribute__((weak)) void epd_draw_pixel(int x, int y, uint8_t color, void *framebuffer)
+{
+    (void) x;
+    (void) y;
+    (void) color;
+    (void) framebuffer;
+}
+
 /*!
    @brief   Draw a single character to a pre-allocated buffer.
 */
@@ -192,15 +489,13 @@ static enum EpdDrawError draw_char(const EpdFont *font, void *buffer,
     int byte_width = (width / 2 + width % 2);
     unsigned long bitmap_size = byte_width * height;
     const uint8_t *bitmap = NULL;
+    uint8_t *tmp_bitmap = NULL;
     if (font->compressed) {
-        uint8_t *tmp_bitmap = (uint8_t *) malloc(bitmap_size);
-        if (tmp_bitmap == NULL && bitmap_size) {
+        bitmap = glyph_cache_get(props->glyph_cache, font, glyph, bitmap_size, &tmp_bitmap);
+        if (bitmap == NULL && bitmap_size) {
             fprintf(stderr, "malloc failed.");
             return EPD_DRAW_FAILED_ALLOC;
         }
-        do_uncompress(tmp_bitmap, bitmap_size, &font->bitmap[offset],
-            glyph->compressed_size);
-        bitmap = tmp_bitmap;
     } else {
         bitmap = &font->bitmap[offset];
     }
@@ -235,9 +530,7 @@ static enum EpdDrawError draw_char(const EpdFont *font, void *buffer,
             x++;
         }
     }
-    if (font->compressed) {
-        free((uint8_t *) bitmap);
-    }
+    free(tmp_bitmap);
     *cursor_x += glyph->advance_x;
     return EPD_DRAW_SUCCESS;
 }
@@ -467,7 +760,17 @@ EpdFont *ufont_load_font(const void *ufont, const void *glyph, const void *inter
 
     memcpy(&serialized_ufont, ufont, sizeof(serialized_ufont));
 
+#ifdef UFONT_NO_INFLATE
+    if (serialized_ufont.compressed) {
+        fprintf(stderr, "compressed fonts are not supported on this target.\n");
+        return NULL;
+    }
+#endif
+
     EpdFont *loaded_font = malloc(sizeof(EpdFont));
+    if (loaded_font == NULL) {
+        return NULL;
+    }
     loaded_font->bitmap = bitmap;
     loaded_font->glyph = glyph;
     loaded_font->intervals = intervals;
@@ -480,87 +783,118 @@ EpdFont *ufont_load_font(const void *ufont, const void *glyph, const void *inter
     return loaded_font;
 }
 
-#define GET_LIST_ENTRY(list_item, type, list_head_member) \
-    ((type *) (((char *) (list_item)) - ((unsigned long) &((type *) 0)->list_head_member)))
-
-#define LIST_FOR_EACH(item, head) \
-    for (item = (head)->next; item != (head); item = item->next)
-
-#define MUTABLE_LIST_FOR_EACH(item, tmp, head) \
-    for (item = (head)->next, tmp = item->next; item != (head); item = tmp, tmp = item->next)
+/*
+ * Fonts are stored in an open addressing table keyed by a non negative integer, such as an atom
+ * index, so looking up a font is an integer probe.
+ */
+#define UF_MANAGER_EMPTY_KEY -1
+#define UF_MANAGER_INITIAL_CAPACITY 8
 
-struct UFListHead;
+typedef struct
+{
+    int key;
+    EpdFont *font;
+} UFontSlot;
 
-struct UFListHead
+struct UFontManager
 {
-    struct UFListHead *next;
-    struct UFListHead *prev;
+    UFontSlot *slots;
+    // power of 2
+    unsigned int capacity;
+    unsigned int count;
 };
 
-static inline void uflist_insert(struct UFListHead *new_item, struct UFListHead *prev_head, struct UFListHead *next_head)
+static inline unsigned int ufont_manager_first_slot(const UFontManager *ufont_manager, int key)
 {
-    new_item->prev = prev_head;
-    new_item->next = next_head;
-    next_head->prev = new_item;
-    prev_head->next = new_item;
+    return ((uint32_t) key * 2654435761U) & (ufont_manager->capacity - 1);
 }
 
-static inline void uflist_append(struct UFListHead *head, struct UFListHead *new_item)
+static UFontSlot *ufont_manager_find_slot(const UFontManager *ufont_manager, int key)
 {
-    uflist_insert(new_item, head->prev, head);
+    unsigned int mask = ufont_manager->capacity - 1;
+    for (unsigned int i = ufont_manager_first_slot(ufont_manager, key);; i = (i + 1) & mask) {
+        UFontSlot *slot = &ufont_manager->slots[i];
+        if (slot->key == key || slot->key == UF_MANAGER_EMPTY_KEY) {
+            return slot;
+        }
+    }
 }
 
-static inline void uflist_remove(struct UFListHead *remove_item)
+static bool ufont_manager_alloc_slots(UFontManager *ufont_manager, unsigned int capacity)
 {
-    remove_item->prev->next = remove_item->next;
-    remove_item->next->prev = remove_item->prev;
-}
+    UFontSlot *slots = malloc(sizeof(UFontSlot) * capacity);
+    if (slots == NULL) {
+        return false;
+    }
+    for (unsigned int i = 0; i < capacity; i++) {
+        slots[i].key = UF_MANAGER_EMPTY_KEY;
+        slots[i].font = NULL;
+    }
+
+    UFontSlot *old_slots = ufont_manager->slots;
+    unsigned int old_capacity = ufont_manager->capacity;
+    ufont_manager->slots = slots;
+    ufont_manager->capacity = capacity;
+    for (unsigned int i = 0; i < old_capacity; i++) {
+        if (old_slots[i].key != UF_MANAGER_EMPTY_KEY) {
+            *ufont_manager_find_slot(ufont_manager, old_slots[i].key) = old_slots[i];
+        }
+    }
+    free(old_slots);
 
-static inline void uflist_init(struct UFListHead *list_item)
-{
-    list_item->prev = list_item;
-    list_item->next = list_item;
+    return true;
 }
 
-typedef struct
-{
-    struct UFListHead list_head;
-    const char *handle;
-    EpdFont *font;
-} UFont;
-
-struct UFontManager
-{
-    struct UFListHead font_list;
-};
-
 UFontManager *ufont_manager_new()
 {
     UFontManager *ufont_manager = malloc(sizeof(UFontManager));
-    uflist_init(&ufont_manager->font_list);
+    if (ufont_manager == NULL) {
+        return NULL;
+    }
+    ufont_manager->slots = NULL;
+    ufont_manager->capacity = 0;
+    ufont_manager->count = 0;
+    if (!ufont_manager_alloc_slots(ufont_manager, UF_MANAGER_INITIAL_CAPACITY)) {
+        free(ufont_manager);
+        return NULL;
+    }
 
     return ufont_manager;
 }
 
-void ufont_manager_register(UFontManager *ufont_manager, const char *handle, EpdFont *font)
+bool ufont_manager_register(UFontManager *ufont_manager, int key, EpdFont *font)
 {
-    UFont *ufont = malloc(sizeof(UFont));
-    ufont->handle = strdup(handle);
-    ufont->font = font;
-    uflist_append(&ufont_manager->font_list, &ufont->list_head);
+    if (key < 0 || font == NULL) {
+        return false;
+    }
+
+    UFontSlot *slot = ufont_manager_find_slot(ufont_manager, key);
+    if (slot->key == key) {
+        return false;
+    }
+
+    // keep the load factor below 3/4, so probe sequences stay short
+    if ((ufont_manager->count + 1) * 4 > ufont_manager->capacity * 3) {
+        if (!ufont_manager_alloc_slots(ufont_manager, ufont_manager->capacity * 2)) {
+            return false;
+        }
+        slot = ufont_manager_find_slot(ufont_manager, key);
+    }
+
+    slot->key = key;
+    slot->font = font;
+    ufont_manager->count++;
+
+    return true;
 }
 
-EpdFont *ufont_manager_find_by_handle(UFontManager *ufont_manager, const char *handle)
+EpdFont *ufont_manager_find(const UFontManager *ufont_manager, int key)
 {
-    struct UFListHead *item;
-    LIST_FOR_EACH (item, &ufont_manager->font_list) {
-        UFont *ufont = GET_LIST_ENTRY(item, UFont, list_head);
-        if (!strcmp(handle, ufont->handle)) {
-            return ufont->font;
-        }
+    if (key < 0) {
+        return NULL;
     }
 
-    return NULL;
+    return ufont_manager_find_slot(ufont_manager, key)->font;
 }
 
 #ifdef __ORDER_LITTLE_ENDIAN__
@@ -27,6 +27,7 @@ extern "C" {
 
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /// Font data stored PER GLYPH
@@ -106,6 +107,9 @@ enum EpdFontFlags {
   EPD_DRAW_ALIGN_CENTER = 0x8,
 };
 
+struct UFontGlyphCache;
+typedef struct UFontGlyphCache UFontGlyphCache;
+
 /// Font properties.
 typedef struct {
   /// Foreground color
@@ -116,6 +120,8 @@ typedef struct {
   uint32_t fallback_glyph;
   /// Additional flags, reserved for future use
   enum EpdFontFlags flags;
+  /// Cache of decompressed glyphs, NULL inflates glyphs each time they are drawn
+  UFontGlyphCache *glyph_cache;
 } EpdFontProperties;
 
 /**
@@ -188,12 +194,52 @@ const EpdGlyph* epd_get_glyph(const EpdFont *font, uint32_t code_point);
 EpdFont *ufont_load_font(const void *ufont, const void *glyph, const void *intervals,
         const void *bitmap);
 
+/// Default size in bytes of the glyph cache, that holds decompressed glyph bitmaps.
+#define UFONT_GLYPH_CACHE_DEFAULT_BUDGET (64 * 1024)
+
+/**
+ * Create a glyph cache, least recently used glyphs are evicted to fit budget bytes. Caches are not
+ * thread safe: each display owns one, that is used only by the task drawing it.
+ */
+UFontGlyphCache *ufont_glyph_cache_new(size_t budget);
+
+void ufont_glyph_cache_destroy(UFontGlyphCache *cache);
+
+/**
+ * Start a new frame: cached bitmaps that are returned by ufont_glyph_bitmap stay valid until the
+ * next call, glyphs that do not fit next to them are returned as temporary bitmaps.
+ */
+void ufont_glyph_cache_next_frame(UFontGlyphCache *cache);
+
+/**
+ * Get the 4 bits per pixel bitmap of a glyph, rows are padded to a byte and the low nibble is the
+ * leftmost pixel. Compressed glyphs are taken from cache, when a glyph doesn't fit it (or cache is
+ * NULL) *to_free is set to a temporary bitmap, that must be freed by the caller. NULL is returned
+ * when the glyph cannot be inflated.
+ */
+const uint8_t *ufont_glyph_bitmap(UFontGlyphCache *cache, const EpdFont *font, const EpdGlyph *glyph,
+        uint8_t **to_free);
+
+/**
+ * Decode the next UTF-8 code point of a NUL terminated string, 0 is returned at its end.
+ */
+uint32_t ufont_next_code_point(const char **string);
+
 struct UFontManager;
 typedef struct UFontManager UFontManager;
 
 UFontManager *ufont_manager_new();
-void ufont_manager_register(UFontManager *ufont_manager, const char *handle, EpdFont *font);
-EpdFont *ufont_manager_find_by_handle(UFontManager *ufont_manager, const char *handle);
+
+/**
+ * Register a font with a non negative key, such as an atom index. Fonts cannot be replaced, so
+ * false is returned when key is already taken, or when there is no memory.
+ */
+bool ufont_manager_register(UFontManager *ufont_manager, int key, EpdFont *font);
+
+/**
+ * Find a registered font, NULL is returned when there isn't any font with key.
+ */
+EpdFont *ufont_manager_find(const UFontManager *ufont_manager, int key);
 
 EpdFont *ufont_parse(const void *iff_binary, int buf_size);
 